@@ -6,10 +6,11 @@
 
 /*  CCOPYRIGHT */
 
-#include "fabber_core/fabber_core.h"
+#include "pet_driver.h"
 
 // Main function to run the fabber pet inference
 int main(int argc, char **argv)
 {
-    return execute(argc, argv);
+    PETDriver driver(argc, argv);
+    return driver.Execute();
 }
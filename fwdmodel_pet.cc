@@ -15,8 +15,13 @@
 #include <newimage/newimageall.h>
 #include <armawrap/newmat.h>
 
+#include <chrono>
+#include <cmath>
 #include <iostream>
 #include <fstream>
+#include <limits>
+#include <list>
+#include <mutex>
 #include <stdexcept>
 
 using namespace std;
@@ -35,9 +40,53 @@ static OptionSpec OPTIONS[] = {
         OPT_NONREQ, "" },
     { "init-vB", OPT_FLOAT, "Initial volume of blood (between 0 and 1)", OPT_NONREQ, "0.03" },
     { "density", OPT_FLOAT, "Density of brain (g/mL)", OPT_NONREQ, "1.05" },
+    { "autotune-tol", OPT_FLOAT,
+        "Pick the fastest AIF grid step and convolution engine whose predicted TACs are within this "
+        "relative error of a high resolution reference (0 to disable)",
+        OPT_NONREQ, "0" },
+    { "varpro", OPT_BOOL,
+        "Solve the linear parameters (vB and amplitudes) by least squares and infer only the rates",
+        OPT_NONREQ, "" },
     { "" },
 };
 
+// Operators built for recent timings. Models initialized with the same
+// timing (one per worker thread, or several models compared in one run)
+// copy them rather than building their own
+struct PETSharedOperators
+{
+    ColumnVector pet_time;
+    ColumnVector aif;
+    ColumnVector aif_time;
+    ColumnVector kernel_time;
+    ColumnVector aif_pet;
+    ColumnVector aif_i;
+    Matrix c_mat;
+    double dt;
+
+    // Autotuning tolerance and the configuration it chose
+    double tol;
+    double dt_scale;
+    int engine;
+};
+
+static const size_t SHARED_OPERATORS_SIZE = 4;
+static list<PETSharedOperators> shared_operators;
+static mutex shared_operators_mutex;
+
+static bool same_vector(const ColumnVector &a, const ColumnVector &b)
+{
+    if (a.Nrows() != b.Nrows()){
+        return false;
+    }
+    for (int i = 1; i <= a.Nrows(); i++){
+        if (a(i) != b(i)){
+            return false;
+        }
+    }
+    return true;
+}
+
 void PETFwdModel::GetOptions(vector<OptionSpec> &opts) const
 {
     for (int i = 0; OPTIONS[i].name != ""; i++)
@@ -127,55 +176,703 @@ Matrix PETFwdModel::interp_matrix(const ColumnVector &x, const ColumnVector &x_p
     return i_mat;
 }
 
+ColumnVector PETFwdModel::solve_linear(const Matrix &basis, const ColumnVector &y) const
+{
+    int n = basis.Ncols();
+    ColumnVector best(n);
+    best = 0.0;
+    double best_ssr = y.SumSquare();
+
+    // Try each subset of columns and keep the best fit with no negative coefficients
+    for (int set = 1; set < (1 << n); set++){
+        vector<int> cols;
+        for (int j = 0; j < n; j++){
+            if (set & (1 << j)){
+                cols.push_back(j + 1);
+            }
+        }
+        Matrix sub(basis.Nrows(), cols.size());
+        for (size_t j = 0; j < cols.size(); j++){
+            sub.Column(j + 1) = basis.Column(cols[j]);
+        }
+
+        ColumnVector coefs;
+        try{
+            coefs = (sub.t() * sub).i() * (sub.t() * y);
+        }
+        catch (...){
+            continue;
+        }
+        if (coefs.Minimum() < 0){
+            continue;
+        }
+
+        double ssr = (y - sub * coefs).SumSquare();
+        if (ssr < best_ssr){
+            best_ssr = ssr;
+            best = 0.0;
+            for (size_t j = 0; j < cols.size(); j++){
+                best(cols[j]) = coefs(j + 1);
+            }
+        }
+    }
+    return best;
+}
+
+const double PETFwdModel::MAX_VB = 0.999;
+
+ColumnVector PETFwdModel::solve_linear_vb(const Matrix &basis, const ColumnVector &y) const
+{
+    ColumnVector coefs = solve_linear(basis, y);
+    int n = basis.Ncols();
+    if (coefs(n) < MAX_VB){
+        return coefs;
+    }
+
+    // The fit is convex, so if the bound is violated it is active at the
+    // optimum - fix vB there and refit the tissue columns to the rest
+    ColumnVector rest = y - MAX_VB * basis.Column(n);
+    coefs = 0.0;
+    if (n > 1){
+        Matrix tissue = basis.Columns(1, n - 1);
+        coefs.Rows(1, n - 1) = solve_linear(tissue, rest);
+    }
+    coefs(n) = MAX_VB;
+    return coefs;
+}
+
+void PETFwdModel::SignalStatistics(const Matrix &data, Matrix &stats) const
+{
+    int n_frames = m_pet_time.Nrows();
+    if (data.Nrows() != n_frames){
+        throw FabberRunDataError("Data does not have the same number of frames as the PET timing");
+    }
+
+    // Trapezoidal areas under the curves at the frame times
+    ColumnVector weights(n_frames);
+    weights = 0.0;
+    for (int i = 1; i < n_frames; i++){
+        double half = (m_pet_time(i + 1) - m_pet_time(i)) / 2;
+        weights(i) += half;
+        weights(i + 1) += half;
+    }
+    double aif_area = DotProduct(weights, m_aif_pet);
+
+    // Blood volume and irreversible uptake span any plausible tissue curve
+    Matrix basis(n_frames, 2);
+    basis.Column(1) = m_aif_pet;
+    basis.Column(2) = ConvolveExp(0);
+
+    stats.ReSize(3, data.Ncols());
+    for (int v = 1; v <= data.Ncols(); v++){
+        ColumnVector tac = data.Column(v);
+        stats(1, v) = (aif_area > 0) ? DotProduct(weights, tac) / aif_area : 0;
+
+        ColumnVector fit = basis * solve_linear(basis, tac);
+        double residual = sqrt((tac - fit).SumSquare());
+        double signal = sqrt(fit.SumSquare());
+        if (residual > 0){
+            stats(2, v) = signal / residual;
+        } else{
+            stats(2, v) = (signal > 0) ? numeric_limits<double>::infinity() : 0;
+        }
+
+        int n_negative = 0;
+        for (int i = 1; i <= n_frames; i++){
+            if (tac(i) < 0){
+                n_negative++;
+            }
+        }
+        stats(3, v) = double(n_negative) / n_frames;
+    }
+}
+
 void PETFwdModel::Initialize(FabberRunData &rundata)
 {
 
     // Initial values of main parameters
     m_init_vB = rundata.GetDoubleDefault("init-vB", 0.03);
     m_density = rundata.GetDoubleDefault("density", 1.05);
+    m_varpro = rundata.GetBool("varpro");
 
     // Read in AIF signal from text file
-    ColumnVector aif = read_ascii_matrix(rundata.GetString("aif-data"));
-    ColumnVector pet_time = read_ascii_matrix(rundata.GetString("pet-time-data"));
+    m_aif = read_ascii_matrix(rundata.GetString("aif-data"));
+    m_pet_time = read_ascii_matrix(rundata.GetString("pet-time-data"));
 
     // Load in aif time vector
     string aif_time_path = rundata.GetStringDefault("aif-time-data", "");
     if ( aif_time_path != "" ){
-        Matrix aif_time = read_ascii_matrix(aif_time_path);
-        
+        m_aif_time = read_ascii_matrix(aif_time_path);
+    } else{
+        m_aif_time.ReSize(0);
+    }
+
+    // Autotuning is done once per timing and shared, so every model
+    // instance in a run uses the same configuration
+    double tol = rundata.GetDoubleDefault("autotune-tol", 0);
+    if (!LoadSharedOperators(tol)){
+        m_dt_scale = 1;
+        m_engine = ENGINE_DENSE;
+        if (tol > 0){
+            Autotune(tol);
+        } else{
+            BuildOperators();
+        }
+        SaveSharedOperators(tol);
+    }
+    PrepareEngine();
+}
+
+bool PETFwdModel::LoadSharedOperators(double tol)
+{
+    lock_guard<mutex> lock(shared_operators_mutex);
+    list<PETSharedOperators>::iterator it;
+    for (it = shared_operators.begin(); it != shared_operators.end(); ++it){
+        if (it->tol == tol && same_vector(it->pet_time, m_pet_time) && same_vector(it->aif, m_aif)
+            && same_vector(it->aif_time, m_aif_time)){
+            m_kernel_time = it->kernel_time;
+            m_aif_pet = it->aif_pet;
+            m_aif_i = it->aif_i;
+            m_c_mat = it->c_mat;
+            m_dt = it->dt;
+            m_dt_scale = it->dt_scale;
+            m_engine = (ConvolutionEngine)it->engine;
+            return true;
+        }
+    }
+    return false;
+}
+
+void PETFwdModel::SaveSharedOperators(double tol) const
+{
+    PETSharedOperators ops;
+    ops.pet_time = m_pet_time;
+    ops.aif = m_aif;
+    ops.aif_time = m_aif_time;
+    ops.kernel_time = m_kernel_time;
+    ops.aif_pet = m_aif_pet;
+    ops.aif_i = m_aif_i;
+    ops.c_mat = m_c_mat;
+    ops.dt = m_dt;
+    ops.tol = tol;
+    ops.dt_scale = m_dt_scale;
+    ops.engine = m_engine;
+
+    lock_guard<mutex> lock(shared_operators_mutex);
+    shared_operators.push_front(ops);
+    if (shared_operators.size() > SHARED_OPERATORS_SIZE){
+        shared_operators.pop_back();
+    }
+}
+
+void PETFwdModel::BuildOperators()
+{
+    if ( m_aif_time.Nrows() > 0 ){
+
         // Figure out smallest sampling time
-        double dt = aif_time(2) - aif_time(1);
+        m_dt = m_aif_time(2) - m_aif_time(1);
         double dt_new;
-        for (int i = 2; i < aif_time.Nrows(); i++){
-            dt_new = aif_time(i + 1) - aif_time(i);
-            if (dt_new < dt){
-                dt = dt_new;
+        for (int i = 2; i < m_aif_time.Nrows(); i++){
+            dt_new = m_aif_time(i + 1) - m_aif_time(i);
+            if (dt_new < m_dt){
+                m_dt = dt_new;
             }
         }
+        m_dt *= m_dt_scale;
         
         // Make new array of timepoints
-        double aif_min = aif_time.Minimum();
-        double aif_max = aif_time.Maximum();
-        int n_i = ceil((aif_max - aif_min) / dt);
+        double aif_min = m_aif_time.Minimum();
+        double aif_max = m_aif_time.Maximum();
+        int n_i = ceil((aif_max - aif_min) / m_dt);
         ColumnVector aif_time_i(n_i);
         for (int i = 1; i <= n_i; i++){
-            aif_time_i(i) = aif_min + (i - 1) * dt;
+            aif_time_i(i) = aif_min + (i - 1) * m_dt;
         }
         m_kernel_time = aif_time_i - aif_min;
         
         // Interpolate aif to even sampling and to pet sampling
-        ColumnVector aif_i = interp_matrix(aif_time, aif_time_i) * aif;
-        m_aif_pet = interp_matrix(aif_time, pet_time) * aif;
+        m_aif_i = interp_matrix(m_aif_time, aif_time_i) * m_aif;
+        m_aif_pet = interp_matrix(m_aif_time, m_pet_time) * m_aif;
         
         // Get matrix to interpolate + convolve
-        m_c_mat = interp_matrix(aif_time_i, pet_time) * convolve_matrix(aif_i) * dt;
+        m_c_mat = Matrix(m_pet_time.Nrows(), n_i);
+        FillConvolutionRows(1, m_aif_i, m_c_mat);
         
     } else{
-        m_c_mat = convolve_matrix(aif) * (pet_time(2) - pet_time(1));
+        m_dt = m_pet_time(2) - m_pet_time(1);
+        m_c_mat = convolve_matrix(m_aif) * m_dt;
+        m_kernel_time = m_pet_time - m_pet_time.Minimum();
+        m_aif_pet = m_aif;
+        m_aif_i = m_aif;
+    }
+}
+
+void PETFwdModel::FillConvolutionRows(int first_row, const ColumnVector &input_i, Matrix &c_mat) const
+{
+    int n_pet = m_pet_time.Nrows();
+    int n_i = m_kernel_time.Nrows();
+    if (first_row > n_pet){
+        return;
+    }
+
+    // Interpolation weights of the frames on the uniform grid
+    Matrix i_mat;
+    if ( m_aif_time.Nrows() > 0 ){
+        ColumnVector aif_time_i = m_kernel_time + m_aif_time.Minimum();
+        ColumnVector pet_time = m_pet_time.Rows(first_row, n_pet);
+        i_mat = interp_matrix(aif_time_i, pet_time);
+    } else{
+        i_mat = Matrix(n_pet - first_row + 1, n_i);
+        i_mat = 0.0;
+        for (int r = first_row; r <= n_pet; r++){
+            i_mat(r - first_row + 1, r) = 1.0;
+        }
+    }
+
+    // Each row is a weighted sum of at most two rows of the convolution
+    // matrix, so build it directly rather than forming the full product
+    for (int r = first_row; r <= n_pet; r++){
+        for (int j = 1; j <= n_i; j++){
+            c_mat(r, j) = 0.0;
+        }
+        for (int k = 1; k <= n_i; k++){
+            double w = i_mat(r - first_row + 1, k);
+            if (w == 0){
+                continue;
+            }
+            for (int j = 1; j <= k; j++){
+                c_mat(r, j) += w * input_i(k - j + 1) * m_dt;
+            }
+        }
+    }
+}
+
+void PETFwdModel::InitializePortalInput(FabberRunData &rundata)
+{
+    ColumnVector pv = read_ascii_matrix(rundata.GetString("pv-data"));
+    double delay = rundata.GetDoubleDefault("pv-delay", 0);
+
+    // Autotuning only checked the accuracy of the AIF operator, so a
+    // coarsened grid or single precision is not used with a second input
+    if (m_dt_scale != 1 || m_engine == ENGINE_CAUSAL_FLOAT){
+        LOG << "PETFwdModel::InitializePortalInput - using the AIF sampling grid and double precision "
+            << "for the dual-input model" << endl;
+        m_dt_scale = 1;
+        if (m_engine == ENGINE_CAUSAL_FLOAT){
+            m_engine = ENGINE_CAUSAL;
+        }
+        BuildOperators();
+        PrepareEngine();
+    }
+
+    // Portal samples share the AIF timing, or the frame times without one
+    ColumnVector pv_time = (m_aif_time.Nrows() > 0) ? m_aif_time : m_pet_time;
+    if (pv.Nrows() != m_aif.Nrows()){
+        throw InvalidOptionValue("pv-data", rundata.GetString("pv-data"),
+                                 "Portal vein curve must have the same number of samples as the AIF");
+    }
+
+    // Delay the portal curve, holding its first value before it starts
+    if (delay != 0){
+        ColumnVector delayed_time = pv_time - delay;
+        ColumnVector delayed = interp_matrix(pv_time, delayed_time) * pv;
+        for (int i = 1; i <= pv.Nrows(); i++){
+            if (delayed_time(i) < pv_time(1)){
+                delayed(i) = pv(1);
+            }
+        }
+        pv = delayed;
+    }
+    m_pv = pv;
+
+    // Convolution operator on the same grid as the AIF operator
+    m_pv_c_mat = Matrix(m_c_mat.Nrows(), m_c_mat.Ncols());
+    if (m_aif_time.Nrows() > 0){
+        ColumnVector aif_time_i = m_kernel_time + m_aif_time.Minimum();
+        ColumnVector pv_i = interp_matrix(m_aif_time, aif_time_i) * pv;
+        m_pv_pet = interp_matrix(m_aif_time, m_pet_time) * pv;
+        FillConvolutionRows(1, pv_i, m_pv_c_mat);
+    } else{
+        m_pv_pet = pv.Rows(1, m_pet_time.Nrows());
+        FillConvolutionRows(1, m_pv_pet, m_pv_c_mat);
+    }
+    ClearConvolutionCache();
+}
+
+ColumnVector PETFwdModel::ConvolveExpPortal(double rate) const
+{
+    return ConvolveCached(KERNEL_EXP_PORTAL, rate);
+}
+
+std::vector<ColumnVector> PETFwdModel::OperatorInputs() const
+{
+    vector<ColumnVector> inputs;
+    inputs.push_back(m_pet_time);
+    inputs.push_back(m_aif);
+    inputs.push_back(m_aif_time);
+    inputs.push_back(m_pv);
+
+    // Autotuning picks the configuration by timing, so it can differ
+    // between runs with the same inputs
+    ColumnVector config(2);
+    config(1) = m_dt_scale;
+    config(2) = m_engine;
+    inputs.push_back(config);
+    return inputs;
+}
+
+void PETFwdModel::UpdateTimings(const ColumnVector &pet_time, const ColumnVector &aif,
+                                const ColumnVector &aif_time)
+{
+    if (m_pv_c_mat.Nrows() > 0){
+        throw FabberRunDataError("Incremental updates are not supported for dual-input models");
+    }
+    bool on_grid = m_aif_time.Nrows() > 0;
+    if ((aif_time.Nrows() > 0) != on_grid){
+        throw FabberRunDataError("AIF timing cannot be added or removed between incremental updates");
+    }
+    if (on_grid && aif_time.Nrows() != aif.Nrows()){
+        throw FabberRunDataError("AIF data and AIF timing have different lengths");
+    }
+    if (!on_grid && aif.Nrows() < pet_time.Nrows()){
+        throw FabberRunDataError("AIF sampled at PET frame times needs a sample for every frame");
+    }
+
+    // Samples already built into the operators must not change
+    int n_aif_old = m_aif.Nrows();
+    if (on_grid && aif.Nrows() < n_aif_old){
+        throw FabberRunDataError("AIF samples cannot be removed between incremental updates");
+    }
+    for (int i = 1; i <= min(n_aif_old, aif.Nrows()); i++){
+        if (aif(i) != m_aif(i) || (on_grid && aif_time(i) != m_aif_time(i))){
+            throw FabberRunDataError("AIF samples changed between incremental updates");
+        }
+    }
+    int n_pet = pet_time.Nrows();
+    int n_keep = min(n_pet, m_pet_time.Nrows());
+    for (int i = 1; i <= n_keep; i++){
+        if (pet_time(i) != m_pet_time(i)){
+            throw FabberRunDataError("PET frame times changed between incremental updates");
+        }
+    }
+
+    int n_i_old = m_kernel_time.Nrows();
+    int n_i = n_pet;
+    int first_row = n_keep + 1;
+    if (on_grid){
+        if (pet_time.Maximum() > aif_time.Maximum()){
+            throw FabberRunDataError("AIF does not yet cover the latest PET frame");
+        }
+
+        // A new smallest sampling interval changes the whole grid
+        for (int i = max(n_aif_old, 1); i < aif_time.Nrows(); i++){
+            if (aif_time(i + 1) - aif_time(i) < m_dt / m_dt_scale){
+                LOG << "PETFwdModel::UpdateTimings - AIF sampling interval decreased, rebuilding operators" << endl;
+                m_pet_time = pet_time;
+                m_aif = aif;
+                m_aif_time = aif_time;
+                BuildOperators();
+                PrepareEngine();
+                return;
+            }
+        }
+
+        // Existing grid points lie between existing samples so they keep their values
+        double aif_min = m_aif_time.Minimum();
+        n_i = ceil((aif_time.Maximum() - aif_min) / m_dt);
+        if (n_i > n_i_old){
+            ColumnVector aif_time_new(n_i - n_i_old);
+            for (int i = n_i_old + 1; i <= n_i; i++){
+                aif_time_new(i - n_i_old) = aif_min + (i - 1) * m_dt;
+            }
+            m_kernel_time = m_kernel_time & (aif_time_new - aif_min);
+            m_aif_i = m_aif_i & (interp_matrix(aif_time, aif_time_new) * aif);
+
+            // Frames past the old grid were extrapolated and need recomputing
+            double grid_max = aif_min + m_kernel_time(n_i_old);
+            for (int i = 1; i <= n_keep; i++){
+                if (pet_time(i) > grid_max){
+                    first_row = i;
+                    break;
+                }
+            }
+        } else{
+            n_i = n_i_old;
+        }
+        m_aif_pet = interp_matrix(aif_time, pet_time) * aif;
+    } else{
         m_kernel_time = pet_time - pet_time.Minimum();
-        m_aif_pet = aif;
+        m_aif_i = aif.Rows(1, n_pet);
+        m_aif_pet = m_aif_i;
     }
-       
+
+    // Rows for frames kept are unchanged as the operator is causal
+    Matrix c_mat(n_pet, n_i);
+    c_mat = 0.0;
+    if (first_row > 1){
+        c_mat.SubMatrix(1, first_row - 1, 1, min(n_i, n_i_old)) =
+            m_c_mat.SubMatrix(1, first_row - 1, 1, min(n_i, n_i_old));
+    }
+    m_c_mat = c_mat;
+    m_pet_time = pet_time;
+    m_aif = on_grid ? aif : m_aif_i;
+    m_aif_time = aif_time;
+    FillConvolutionRows(first_row, m_aif_i, m_c_mat);
+    PrepareEngine();
+}
+
+void PETFwdModel::PrepareEngine()
+{
+    // Called whenever the operators change, so cached results are stale
+    ClearConvolutionCache();
+
+    m_row_len.clear();
+    m_row_start.clear();
+    m_c_packed.clear();
+    m_c_packed_float.clear();
+    if (m_engine == ENGINE_DENSE){
+        return;
+    }
+
+    // The operator is causal, so each row ends at the grid point of its frame
+    for (int i = 1; i <= m_c_mat.Nrows(); i++){
+        int len = m_c_mat.Ncols();
+        while (len > 0 && m_c_mat(i, len) == 0){
+            len--;
+        }
+        m_row_start.push_back(m_c_packed.size());
+        m_row_len.push_back(len);
+        for (int j = 1; j <= len; j++){
+            m_c_packed.push_back(m_c_mat(i, j));
+        }
+    }
+    if (m_engine == ENGINE_CAUSAL_FLOAT){
+        m_c_packed_float.assign(m_c_packed.begin(), m_c_packed.end());
+        m_c_packed.clear();
+    }
+}
+
+ColumnVector PETFwdModel::Convolve(const ColumnVector &kernel) const
+{
+    if (m_engine == ENGINE_DENSE){
+        return m_c_mat * kernel;
+    }
+
+    int n_rows = m_row_len.size();
+    ColumnVector result(n_rows);
+    if (m_engine == ENGINE_CAUSAL){
+        for (int i = 0; i < n_rows; i++){
+            const double *row = m_c_packed.data() + m_row_start[i];
+            double sum = 0;
+            for (int j = 0; j < m_row_len[i]; j++){
+                sum += row[j] * kernel(j + 1);
+            }
+            result(i + 1) = sum;
+        }
+    } else{
+        vector<float> kernel_float(kernel.Nrows());
+        for (int j = 0; j < kernel.Nrows(); j++){
+            kernel_float[j] = kernel(j + 1);
+        }
+        for (int i = 0; i < n_rows; i++){
+            const float *row = m_c_packed_float.data() + m_row_start[i];
+            float sum = 0;
+            for (int j = 0; j < m_row_len[i]; j++){
+                sum += row[j] * kernel_float[j];
+            }
+            result(i + 1) = sum;
+        }
+    }
+    return result;
+}
+
+ColumnVector PETFwdModel::ConvolveExp(double rate) const
+{
+    return ConvolveCached(KERNEL_EXP, rate);
+}
+
+ColumnVector PETFwdModel::ConvolveExpComplement(double rate) const
+{
+    return ConvolveCached(KERNEL_EXP_COMPLEMENT, rate);
+}
+
+ColumnVector PETFwdModel::ConvolveCached(CachedKernel kernel, double rate) const
+{
+    // Small enough to search linearly, large enough for the rates of the
+    // current point and its finite-difference and line-search neighbours
+    static const size_t CONV_CACHE_SIZE = 8;
+
+    for (size_t i = 0; i < m_conv_cache.size(); i++){
+        if (m_conv_cache[i].kernel == kernel && m_conv_cache[i].rate == rate){
+            return m_conv_cache[i].result;
+        }
+    }
+
+    CachedConvolution entry;
+    entry.kernel = kernel;
+    entry.rate = rate;
+    ColumnVector exp_kernel = MISCMATHS::exp(-rate * m_kernel_time);
+    if (kernel == KERNEL_EXP){
+        entry.result = Convolve(exp_kernel);
+    } else if (kernel == KERNEL_EXP_COMPLEMENT){
+        ColumnVector complement = 1 - exp_kernel;
+        entry.result = Convolve(complement);
+    } else{
+        entry.result = m_pv_c_mat * exp_kernel;
+    }
+
+    if (m_conv_cache.size() < CONV_CACHE_SIZE){
+        m_conv_cache.push_back(entry);
+    } else{
+        m_conv_cache[m_conv_cache_next] = entry;
+        m_conv_cache_next = (m_conv_cache_next + 1) % CONV_CACHE_SIZE;
+    }
+    return entry.result;
+}
+
+Matrix PETFwdModel::ExpKernels(const ColumnVector &rates) const
+{
+    Matrix kernels(m_kernel_time.Nrows(), rates.Nrows());
+    for (int j = 1; j <= rates.Nrows(); j++){
+        for (int i = 1; i <= m_kernel_time.Nrows(); i++){
+            kernels(i, j) = std::exp(-rates(j) * m_kernel_time(i));
+        }
+    }
+    return kernels;
+}
+
+Matrix PETFwdModel::ConvolveBatch(const Matrix &kernels) const
+{
+    if (m_engine != ENGINE_CAUSAL_FLOAT){
+        return m_c_mat * kernels;
+    }
+
+    // Same single precision operator as the one-at-a-time evaluations
+    Matrix result(m_c_mat.Nrows(), kernels.Ncols());
+    for (int j = 1; j <= kernels.Ncols(); j++){
+        ColumnVector kernel = kernels.Column(j);
+        result.Column(j) = Convolve(kernel);
+    }
+    return result;
+}
+
+void PETFwdModel::EvaluateBatch(const Matrix &params, Matrix &results) const
+{
+    results.ReSize(m_pet_time.Nrows(), params.Ncols());
+    for (int s = 1; s <= params.Ncols(); s++){
+        ColumnVector sample = params.Column(s);
+        ColumnVector result;
+        EvaluateModel(sample, result);
+        results.Column(s) = result;
+    }
+}
+
+void PETFwdModel::ClearConvolutionCache()
+{
+    m_conv_cache.clear();
+    m_conv_cache_next = 0;
+}
+
+void PETFwdModel::Autotune(double tol)
+{
+    static const char *ENGINE_NAMES[] = { "dense", "causal", "causal-float" };
+
+    // Kernels spanning the range of PET rate constants (1/s)
+    double rates[] = { 0, 1e-4, 1e-3, 1e-2, 1e-1 };
+    int n_rates = sizeof(rates) / sizeof(rates[0]);
+
+    // Reference - grid at a quarter of the AIF sampling interval. The grid
+    // can only be changed if the AIF has its own timing
+    bool on_grid = m_aif_time.Nrows() > 0;
+    m_dt_scale = on_grid ? 0.25 : 1;
+    m_engine = ENGINE_DENSE;
+    BuildOperators();
+    PrepareEngine();
+    vector<ColumnVector> reference;
+    for (int k = 0; k < n_rates; k++){
+        reference.push_back(ConvolveExp(rates[k]));
+    }
+
+    vector<double> scales;
+    scales.push_back(1);
+    if (on_grid){
+        scales.push_back(2);
+        scales.push_back(4);
+        scales.push_back(8);
+    }
+
+    double best_time = numeric_limits<double>::infinity();
+    double best_scale = 1;
+    double best_error = 0;
+    ConvolutionEngine best_engine = ENGINE_DENSE;
+
+    // Most accurate candidate, used if none is within tolerance
+    double closest_error = numeric_limits<double>::infinity();
+    double closest_time = numeric_limits<double>::infinity();
+    double closest_scale = 1;
+    ConvolutionEngine closest_engine = ENGINE_DENSE;
+    for (size_t s = 0; s < scales.size(); s++){
+        m_dt_scale = scales[s];
+        BuildOperators();
+        vector<ColumnVector> kernels;
+        for (int k = 0; k < n_rates; k++){
+            kernels.push_back(MISCMATHS::exp(-rates[k] * m_kernel_time));
+        }
+        for (int e = ENGINE_DENSE; e <= ENGINE_CAUSAL_FLOAT; e++){
+            m_engine = (ConvolutionEngine)e;
+            PrepareEngine();
+
+            // Largest error relative to the peak of each reference TAC
+            double error = 0;
+            for (int k = 0; k < n_rates; k++){
+                ColumnVector diff = ConvolveExp(rates[k]) - reference[k];
+                double peak = reference[k].MaximumAbsoluteValue();
+                if (peak > 0){
+                    error = max(error, diff.MaximumAbsoluteValue() / peak);
+                }
+            }
+
+            // Best of a few timed repeats, bypassing the memoised results
+            double time = numeric_limits<double>::infinity();
+            for (int r = 0; r < 5; r++){
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                for (int k = 0; k < n_rates; k++){
+                    Convolve(kernels[k]);
+                }
+                time = min(time, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+            }
+
+            LOG << "PETFwdModel::Autotune - grid step " << m_dt << "s, " << ENGINE_NAMES[e]
+                << ": error " << error << ", time " << time / n_rates * 1e6 << "us" << endl;
+            if (error <= tol && time < best_time){
+                best_time = time;
+                best_scale = scales[s];
+                best_engine = m_engine;
+                best_error = error;
+            }
+            if (error < closest_error || (error == closest_error && time < closest_time)){
+                closest_error = error;
+                closest_time = time;
+                closest_scale = scales[s];
+                closest_engine = m_engine;
+            }
+        }
+    }
+
+    if (best_time == numeric_limits<double>::infinity()){
+        LOG << "PETFwdModel::Autotune - no configuration within tolerance " << tol
+            << ", using the most accurate" << endl;
+        best_scale = closest_scale;
+        best_engine = closest_engine;
+        best_error = closest_error;
+    }
+    m_dt_scale = best_scale;
+    m_engine = best_engine;
+    BuildOperators();
+    LOG << "PETFwdModel::Autotune - using grid step " << m_dt << "s, " << ENGINE_NAMES[m_engine]
+        << " engine, error " << best_error << endl;
+    LOG << "PETFwdModel::Autotune - configuration dt-scale=" << m_dt_scale << " engine="
+        << ENGINE_NAMES[m_engine] << endl;
 }
 
 void PETFwdModel::GetParameterDefaults(std::vector<Parameter> &params) const
@@ -184,6 +881,9 @@ void PETFwdModel::GetParameterDefaults(std::vector<Parameter> &params) const
 
     // Basic model parameters
     int p = 0;
+    if (m_varpro){
+        return;
+    }
     params.push_back(Parameter(p++, "vB", DistParams(m_init_vB, 10), DistParams(m_init_vB, 10), PRIOR_NORMAL, TRANSFORM_LOG()));
 }
 
@@ -23,6 +23,14 @@ using namespace NEWMAT;
 class PETFwdModel : public FwdModel
 {
 public:
+    PETFwdModel()
+        : m_varpro(false)
+        , m_dt_scale(1)
+        , m_engine(ENGINE_DENSE)
+        , m_conv_cache_next(0)
+    {
+    }
+
     virtual ~PETFwdModel()
     {
     }
@@ -36,8 +44,153 @@ public:
     
     virtual Matrix convolve_matrix(const ColumnVector &kernel) const;
     virtual Matrix interp_matrix(const ColumnVector &x, const ColumnVector &x_p) const;
-    
+
+    /**
+     * Non-negative least squares fit of the columns of a basis to data
+     *
+     * Solves every active set exactly, which is cheap for the two or three
+     * linear columns of the PET models.
+     */
+    virtual ColumnVector solve_linear(const Matrix &basis, const ColumnVector &y) const;
+
+    /**
+     * As solve_linear, with the last column being the blood curve whose
+     * coefficient (vB) is also kept below MAX_VB
+     */
+    ColumnVector solve_linear_vb(const Matrix &basis, const ColumnVector &y) const;
+
+    // Upper bound of a solved blood volume, so that 1 - vB stays positive
+    static const double MAX_VB;
+
+    /**
+     * Cheap signal statistics of each voxel's TAC, for skipping background
+     * voxels before fitting
+     *
+     * @param data  One column per voxel, one row per frame
+     * @param stats Row 1: area under the TAC relative to that of the AIF.
+     *              Row 2: SNR of a non-negative fit of the blood and
+     *              integrated blood curves (norm of fit / norm of residual).
+     *              Row 3: fraction of frames with negative values.
+     */
+    void SignalStatistics(const Matrix &data, Matrix &stats) const;
+
+    /**
+     * Bring the AIF and convolution operators up to date with a new frame
+     * schedule and blood curve, for incremental fitting during acquisition.
+     *
+     * Frames and AIF samples shared with the current timing are kept and
+     * only the rows/columns for new frames and samples are computed. A
+     * shorter frame schedule drops the trailing frames. If the new blood
+     * samples change the interpolation grid the operators are rebuilt.
+     *
+     * @param pet_time Frame times (must start with the current frame times)
+     * @param aif      AIF samples (must start with the current samples)
+     * @param aif_time AIF sample times, or empty if the AIF is sampled at
+     *                 the frame times
+     */
+    virtual void UpdateTimings(const ColumnVector &pet_time, const ColumnVector &aif,
+                               const ColumnVector &aif_time);
+
+    /** Number of PET frames the operators are currently built for */
+    int NumFrames() const { return m_pet_time.Nrows(); }
+
+    /**
+     * Timing and input curves the operators were built from, followed by
+     * the grid scale and convolution engine, so saved results can be
+     * checked against the current inputs and configuration
+     */
+    std::vector<ColumnVector> OperatorInputs() const;
+
+    /**
+     * Convolve a kernel sampled at m_kernel_time with the AIF, giving the
+     * result at the PET frame times. Uses the configured convolution engine.
+     */
+    ColumnVector Convolve(const ColumnVector &kernel) const;
+
+    /**
+     * Convolve exp(-rate * t) with the AIF
+     *
+     * Results are memoised on the exact rate, so evaluations which only
+     * change linear parameters cost a linear combination of cached columns.
+     * The cache belongs to the model instance, so an instance must not be
+     * evaluated from several threads at once.
+     */
+    ColumnVector ConvolveExp(double rate) const;
+
+    /** Convolve 1 - exp(-rate * t) with the AIF (memoised as above) */
+    ColumnVector ConvolveExpComplement(double rate) const;
+
+    /**
+     * Evaluate the model for many parameter vectors at once, e.g. the
+     * proposals of all chains of an MCMC sampler
+     *
+     * The default evaluates one column at a time. Models override it to
+     * convolve the kernels of all columns in a single operator product.
+     *
+     * @param params  One column of model parameters per evaluation
+     * @param results One column of frame values per evaluation
+     */
+    virtual void EvaluateBatch(const Matrix &params, Matrix &results) const;
+
 protected:
+    // How the convolution operator is stored and applied
+    enum ConvolutionEngine
+    {
+        ENGINE_DENSE,       // Full m_c_mat product
+        ENGINE_CAUSAL,      // Each row only up to its last non-zero column
+        ENGINE_CAUSAL_FLOAT // As above in single precision
+    };
+
+    void BuildOperators();
+    void FillConvolutionRows(int first_row, const ColumnVector &input_i, Matrix &c_mat) const;
+    bool LoadSharedOperators(double tol);
+    void SaveSharedOperators(double tol) const;
+    void PrepareEngine();
+    void Autotune(double tol);
+
+    /**
+     * Build the operator of a second (portal venous) input curve for the
+     * dual-input models, on the grid and frames of the AIF operator
+     *
+     * Reads pv-data, sampled at the AIF times, and the global pv-delay.
+     * Autotuning is only checked against the AIF, so this reverts to the
+     * AIF sampling grid and a double precision engine if it chose otherwise.
+     */
+    void InitializePortalInput(FabberRunData &rundata);
+
+    /** Convolve exp(-rate * t) with the portal input (memoised as above) */
+    ColumnVector ConvolveExpPortal(double rate) const;
+
+    // Kernels whose convolutions are memoised
+    enum CachedKernel
+    {
+        KERNEL_EXP,            // exp(-rate * t) with the AIF
+        KERNEL_EXP_COMPLEMENT, // 1 - exp(-rate * t) with the AIF
+        KERNEL_EXP_PORTAL      // exp(-rate * t) with the portal input
+    };
+
+    struct CachedConvolution
+    {
+        CachedKernel kernel;
+        double rate;
+        ColumnVector result;
+    };
+
+    ColumnVector ConvolveCached(CachedKernel kernel, double rate) const;
+
+    /** Kernels exp(-rate * t) at m_kernel_time, one column per rate */
+    Matrix ExpKernels(const ColumnVector &rates) const;
+
+    /**
+     * Convolve many kernels with the AIF
+     *
+     * The dense and causal engines apply the same double precision
+     * coefficients, so both use one matrix-matrix product, which is faster
+     * than the packed rows. The single precision engine convolves each
+     * kernel with its packed rows so batched and single evaluations agree.
+     */
+    Matrix ConvolveBatch(const Matrix &kernels) const;
+    void ClearConvolutionCache();
 
     ColumnVector m_kernel_time;
     ColumnVector m_aif_pet;
@@ -45,4 +198,35 @@ protected:
     double m_init_vB;
     double m_density;
 
+    // Variable projection - linear parameters are solved rather than inferred
+    bool m_varpro;
+
+    // Timing the operators were built from
+    ColumnVector m_pet_time;
+    ColumnVector m_aif;
+    ColumnVector m_aif_time;
+    ColumnVector m_aif_i;
+    double m_dt;
+
+    // Grid step as a multiple of the smallest AIF sampling interval
+    double m_dt_scale;
+    ConvolutionEngine m_engine;
+
+    // Rows of m_c_mat packed up to their last non-zero column
+    std::vector<int> m_row_len;
+    std::vector<long> m_row_start;
+    std::vector<double> m_c_packed;
+    std::vector<float> m_c_packed_float;
+
+    // Delayed portal input at the AIF times, its operator and frame-time
+    // samples, if any
+    ColumnVector m_pv;
+    Matrix m_pv_c_mat;
+    ColumnVector m_pv_pet;
+
+    // Recent convolutions, replaced oldest first. Cleared whenever the
+    // operators change
+    mutable std::vector<CachedConvolution> m_conv_cache;
+    mutable size_t m_conv_cache_next;
+
 };
@@ -61,9 +61,11 @@ void PET_1TCM_FwdModel::GetParameterDefaults(std::vector<Parameter> &params) con
     int p = params.size();
 
     // specific parameters
-    params.push_back(Parameter(p++, "K1", DistParams(m_init_K1, 100),
-                               DistParams(m_init_K1, 100), PRIOR_NORMAL,
-                               TRANSFORM_LOG()));
+    if (!m_varpro){
+        params.push_back(Parameter(p++, "K1", DistParams(m_init_K1, 100),
+                                   DistParams(m_init_K1, 100), PRIOR_NORMAL,
+                                   TRANSFORM_LOG()));
+    }
     params.push_back(Parameter(p++, "k2", DistParams(m_init_k2, 100),
                                DistParams(m_init_k2, 100), PRIOR_NORMAL,
                                TRANSFORM_LOG()));
@@ -75,24 +77,70 @@ void PET_1TCM_FwdModel::EvaluateModel(const ColumnVector &params, ColumnVector &
         Evaluate(params, result);
     }
     else{
+        ColumnVector full = FullParams(params);
         result.ReSize(1);
-        result(1) = params(2) * 6000.0 / m_density;
+        if (key == "vB"){
+            result(1) = full(1);
+        } else if (key == "K1"){
+            result(1) = full(2);
+        } else{
+            result(1) = full(2) * 6000.0 / m_density;
+        }
     } 
 }
 
+void PET_1TCM_FwdModel::EvaluateBatch(const Matrix &params, Matrix &results) const
+{
+    if (m_varpro){
+        PETFwdModel::EvaluateBatch(params, results);
+        return;
+    }
+
+    // Kernels of all columns are convolved in one operator product
+    ColumnVector k2 = params.Row(3).t();
+    Matrix conv = ConvolveBatch(ExpKernels(k2));
+
+    results.ReSize(m_aif_pet.Nrows(), params.Ncols());
+    for (int s = 1; s <= params.Ncols(); s++){
+        double vB = params(1, s);
+        double K1 = params(2, s);
+        results.Column(s) = (1 - vB) * K1 * conv.Column(s) + vB * m_aif_pet;
+    }
+}
+
+ColumnVector PET_1TCM_FwdModel::FullParams(const ColumnVector &params) const
+{
+    if (!m_varpro){
+        return params;
+    }
+
+    // Only k2 is inferred, vB and K1 follow from a linear fit to the data
+    double k2 = params(1);
+    Matrix basis(m_aif_pet.Nrows(), 2);
+    basis.Column(1) = ConvolveExp(k2);
+    basis.Column(2) = m_aif_pet;
+    ColumnVector coefs = solve_linear_vb(basis, data);
+
+    ColumnVector full(3);
+    full(1) = coefs(2);
+    full(2) = coefs(1) / (1 - coefs(2));
+    full(3) = k2;
+    return full;
+}
+
 
 void PET_1TCM_FwdModel::Evaluate(const ColumnVector &params, ColumnVector &result) const
 {
     // Parameters that are inferred - extract and give sensible names
+    ColumnVector full = FullParams(params);
     int p = 1;
 
-    double vB = params(p++);
-    double K1 = params(p++);
-    double k2 = params(p++);
+    double vB = full(p++);
+    double K1 = full(p++);
+    double k2 = full(p++);
 
 
-    ColumnVector exp_results = MISCMATHS::exp((-k2) * m_kernel_time);
-    ColumnVector convolution_result = m_c_mat * exp_results;
+    ColumnVector convolution_result = ConvolveExp(k2);
    
     result = (1 - vB) * K1 * convolution_result + vB * m_aif_pet;
 
@@ -113,6 +161,10 @@ void PET_1TCM_FwdModel::Evaluate(const ColumnVector &params, ColumnVector &resul
 void PET_1TCM_FwdModel::GetOutputs(std::vector<std::string> &outputs) const
 {
     outputs.push_back("CBF");
+    if (m_varpro){
+        outputs.push_back("vB");
+        outputs.push_back("K1");
+    }
 }
 
 FwdModel *PET_1TCM_FwdModel::NewInstance()
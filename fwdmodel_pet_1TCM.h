@@ -33,15 +33,17 @@ public:
     void Initialize(FabberRunData &rundata);
     void GetParameterDefaults(std::vector<Parameter> &params) const;
     void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result, const std::string &key = "") const;
+    void EvaluateBatch(const NEWMAT::Matrix &params, NEWMAT::Matrix &results) const;
     void GetOutputs(std::vector<std::string> &outputs) const;
 
 protected:
     void Evaluate(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result) const;
+    NEWMAT::ColumnVector FullParams(const NEWMAT::ColumnVector &params) const;
 
-private:
     double m_init_K1;
     double m_init_k2;
-    
+
+private:
     /** Auto-register with forward model factory. */
     static FactoryRegistration<FwdModelFactory, PET_1TCM_FwdModel> registration;
 };
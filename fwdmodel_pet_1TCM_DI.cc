@@ -0,0 +1,111 @@
+/**
+ * fwdmodel_pet_1TCM_DI.cc
+ *
+ * Dual-input (hepatic artery + portal vein) one tissue compartment model for PET
+ */
+
+/*  CCOPYRIGHT */
+
+#include "fwdmodel_pet_1TCM_DI.h"
+
+#include <fabber_core/easylog.h>
+#include <fabber_core/priors.h>
+
+#include <miscmaths/miscprob.h>
+#include <newimage/newimageall.h>
+#include <armawrap/newmat.h>
+
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+using namespace NEWMAT;
+
+FactoryRegistration<FwdModelFactory, PET_1TCM_DI_FwdModel> PET_1TCM_DI_FwdModel::registration("pet_1TCM_DI");
+
+std::string PET_1TCM_DI_FwdModel::GetDescription() const
+{
+    return "PET dual-input one tissue compartment model";
+}
+
+static OptionSpec OPTIONS[] = {
+    {"pv-data", OPT_MATRIX,
+     "File containing single-column ASCII data defining the portal vein input, sampled at the AIF times",
+     OPT_REQ, ""},
+    {"pv-delay", OPT_FLOAT, "Delay of the portal vein input (s)", OPT_NONREQ, "0"},
+    {"init-fA", OPT_FLOAT, "Arterial fraction of the input (between 0 and 1)", OPT_NONREQ,
+     "0.25"},
+    { "" },
+};
+
+void PET_1TCM_DI_FwdModel::GetOptions(vector<OptionSpec> &opts) const
+{
+    PET_1TCM_FwdModel::GetOptions(opts);
+    for (int i = 0; OPTIONS[i].name != ""; i++) {
+        opts.push_back(OPTIONS[i]);
+  }
+}
+
+void PET_1TCM_DI_FwdModel::Initialize(FabberRunData &rundata)
+{
+    PET_1TCM_FwdModel::Initialize(rundata);
+    if (m_varpro){
+        throw InvalidOptionValue("varpro", "", "Not supported by the dual-input models");
+    }
+
+    // One operator per input, so the arterial fraction enters linearly
+    InitializePortalInput(rundata);
+    m_init_fA = rundata.GetDoubleDefault("init-fA", 0.25);
+}
+
+void PET_1TCM_DI_FwdModel::GetParameterDefaults(std::vector<Parameter> &params) const
+{
+    PET_1TCM_FwdModel::GetParameterDefaults(params);
+    
+    int p = params.size();
+
+    // specific parameters
+    params.push_back(Parameter(p++, "fA", DistParams(m_init_fA, 1),
+                               DistParams(m_init_fA, 1), PRIOR_NORMAL,
+                               TRANSFORM_FRACTIONAL()));
+}
+
+void PET_1TCM_DI_FwdModel::EvaluateBatch(const Matrix &params, Matrix &results) const
+{
+    // The single-input batch does not know about the portal input
+    PETFwdModel::EvaluateBatch(params, results);
+}
+
+void PET_1TCM_DI_FwdModel::Evaluate(const ColumnVector &params, ColumnVector &result) const
+{
+    // Parameters that are inferred - extract and give sensible names
+    int p = 1;
+
+    double vB = params(p++);
+    double K1 = params(p++);
+    double k2 = params(p++);
+    double fA = params(p++);
+
+    ColumnVector convolution_result = fA * ConvolveExp(k2) + (1 - fA) * ConvolveExpPortal(k2);
+    ColumnVector blood = fA * m_aif_pet + (1 - fA) * m_pv_pet;
+   
+    result = (1 - vB) * K1 * convolution_result + vB * blood;
+
+    for (int i = 1; i <= data.Nrows(); i++)
+    {
+        if (isnan(result(i)) || isinf(result(i)))
+        {
+            LOG << "Warning NaN or inf in result" << endl;
+            LOG << "result: " << result.t() << endl;
+            LOG << "params: " << params.t() << endl;
+
+            result = 0.0;
+            break;
+        }
+    }
+}
+
+FwdModel *PET_1TCM_DI_FwdModel::NewInstance()
+{
+    return new PET_1TCM_DI_FwdModel();
+}
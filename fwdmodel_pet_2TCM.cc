@@ -64,12 +64,14 @@ void PET_2TCM_FwdModel::GetParameterDefaults(
   int p = params.size();
 
   // specific parameters
-  params.push_back(Parameter(p++, "alpha_1", DistParams(m_init_alpha_1, 100),
-                             DistParams(m_init_alpha_1, 100), PRIOR_NORMAL,
-                             TRANSFORM_LOG()));
-  params.push_back(Parameter(p++, "alpha_2", DistParams(m_init_alpha_2, 100),
-                             DistParams(m_init_alpha_2, 100), PRIOR_NORMAL,
-                             TRANSFORM_LOG()));
+  if (!m_varpro) {
+    params.push_back(Parameter(p++, "alpha_1", DistParams(m_init_alpha_1, 100),
+                               DistParams(m_init_alpha_1, 100), PRIOR_NORMAL,
+                               TRANSFORM_LOG()));
+    params.push_back(Parameter(p++, "alpha_2", DistParams(m_init_alpha_2, 100),
+                               DistParams(m_init_alpha_2, 100), PRIOR_NORMAL,
+                               TRANSFORM_LOG()));
+  }
   params.push_back(Parameter(p++, "beta_1", DistParams(m_init_beta_1, 100),
                              DistParams(m_init_beta_1, 100), PRIOR_NORMAL,
                              TRANSFORM_LOG()));
@@ -84,11 +86,60 @@ void PET_2TCM_FwdModel::EvaluateModel(const ColumnVector &params,
                                          const std::string &key) const {
   if (key == "") {
     Evaluate(params, result);
+  } else if (key == "vB" || key == "alpha_1" || key == "alpha_2") {
+    ColumnVector full = FullParams(params);
+    result.ReSize(1);
+    result(1) = full(key == "vB" ? 1 : (key == "alpha_1" ? 2 : 3));
   } else {
-    ConvertParams(params, result, key);
+    ConvertParams(FullParams(params), result, key);
+  }
+}
+
+void PET_2TCM_FwdModel::EvaluateBatch(const Matrix &params,
+                                      Matrix &results) const {
+  if (m_varpro) {
+    PETFwdModel::EvaluateBatch(params, results);
+    return;
+  }
+
+  // Kernels of both exponentials of all columns in one operator product
+  int n = params.Ncols();
+  ColumnVector betas = params.Row(4).t() & params.Row(5).t();
+  Matrix conv = ConvolveBatch(ExpKernels(betas));
+
+  results.ReSize(m_aif_pet.Nrows(), n);
+  for (int s = 1; s <= n; s++) {
+    double vB = params(1, s);
+    double alpha_1 = params(2, s);
+    double alpha_2 = params(3, s);
+    results.Column(s) = alpha_1 * conv.Column(s) + alpha_2 * conv.Column(n + s) +
+                        vB * m_aif_pet;
   }
 }
 
+ColumnVector PET_2TCM_FwdModel::FullParams(const ColumnVector &params) const {
+  if (!m_varpro) {
+    return params;
+  }
+
+  // Only the betas are inferred, alphas and vB follow from a linear fit
+  double beta_1 = params(1);
+  double beta_2 = params(2);
+  Matrix basis(m_aif_pet.Nrows(), 3);
+  basis.Column(1) = ConvolveExp(beta_1);
+  basis.Column(2) = ConvolveExp(beta_2);
+  basis.Column(3) = m_aif_pet;
+  ColumnVector coefs = solve_linear_vb(basis, data);
+
+  ColumnVector full(5);
+  full(1) = coefs(3);
+  full(2) = coefs(1);
+  full(3) = coefs(2);
+  full(4) = beta_1;
+  full(5) = beta_2;
+  return full;
+}
+
 void PET_2TCM_FwdModel::ConvertParams(const ColumnVector &params,
                                       ColumnVector &result,
                                       const std::string &key) const {
@@ -100,6 +151,14 @@ void PET_2TCM_FwdModel::ConvertParams(const ColumnVector &params,
     double alpha_2 = params(p++);
     double beta_1 = params(p++);
     double beta_2 = params(p++);
+    result.ReSize(m_ca != 0 ? 7 : 6);
+
+    // Without uptake (e.g. both alphas solved to zero) the rate constants
+    // are undefined
+    if (alpha_1 + alpha_2 <= 0){
+        result = 0.0;
+        return;
+    }
     
     // convert from optimized parameters to rate constants (see Hong and Fryer, Neuroimage,s 2010)
     double K1 = (alpha_1 + alpha_2) / (1.0 - vB) * 6000.0 / m_density;
@@ -117,10 +176,7 @@ void PET_2TCM_FwdModel::ConvertParams(const ColumnVector &params,
     double Vt = K1 / k2 * (1.0 + k3 / k4);
     double cmr;
     if (m_ca != 0){
-        result.ReSize(7);
         cmr = Ki * m_ca / 18.0156 / m_lc;
-    } else{
-        result.ReSize(6);
     }
     
     // Save parameters
@@ -139,16 +195,17 @@ void PET_2TCM_FwdModel::ConvertParams(const ColumnVector &params,
 void PET_2TCM_FwdModel::Evaluate(const ColumnVector &params,
                                     ColumnVector &result) const {
   // Parameters that are inferred - extract and give sensible names
+  ColumnVector full = FullParams(params);
   int p = 1;
 
-  double vB = params(p++);
-  double alpha_1 = params(p++);
-  double alpha_2 = params(p++);
-  double beta_1 = params(p++);
-  double beta_2 = params(p++);
+  double vB = full(p++);
+  double alpha_1 = full(p++);
+  double alpha_2 = full(p++);
+  double beta_1 = full(p++);
+  double beta_2 = full(p++);
 
-  ColumnVector c_1 = alpha_1 * m_c_mat * MISCMATHS::exp(-beta_1 * m_kernel_time);
-  ColumnVector c_2 = alpha_2 * m_c_mat * MISCMATHS::exp(-beta_2 * m_kernel_time);
+  ColumnVector c_1 = alpha_1 * ConvolveExp(beta_1);
+  ColumnVector c_2 = alpha_2 * ConvolveExp(beta_2);
 
   result = c_1 + c_2 + vB * m_aif_pet;
 
@@ -166,6 +223,11 @@ void PET_2TCM_FwdModel::Evaluate(const ColumnVector &params,
 
 void PET_2TCM_FwdModel::GetOutputs(std::vector<std::string> &outputs) const {
   outputs.push_back("rates");
+  if (m_varpro) {
+    outputs.push_back("vB");
+    outputs.push_back("alpha_1");
+    outputs.push_back("alpha_2");
+  }
 }
 
 FwdModel *PET_2TCM_FwdModel::NewInstance() {
@@ -28,13 +28,14 @@ public:
     void Initialize(FabberRunData &rundata);
     void GetParameterDefaults(std::vector<Parameter> &params) const;
     void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result, const std::string &key = "") const;
+    void EvaluateBatch(const NEWMAT::Matrix &params, NEWMAT::Matrix &results) const;
     void ConvertParams(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result, const std::string &key = "") const;
     void GetOutputs(std::vector<std::string> &outputs) const;
 
 protected:
      void Evaluate(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result) const;
+     NEWMAT::ColumnVector FullParams(const NEWMAT::ColumnVector &params) const;
 
-private:
     // Initial values of model parameters - always inferred
     double m_init_alpha_1;
     double m_init_alpha_2;
@@ -43,6 +44,7 @@ private:
     double m_ca;
     double m_lc;
 
+private:
     /** Auto-register with forward model factory. */
     static FactoryRegistration<FwdModelFactory, PET_2TCM_FwdModel> registration;
 };
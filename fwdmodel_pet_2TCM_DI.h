@@ -0,0 +1,42 @@
+/**
+ * fwdmodel_pet_2TCM_DI.h
+ *
+ * Dual-input (hepatic artery + portal vein) two tissue compartment model for PET
+ */
+
+#pragma once
+
+#include "fwdmodel_pet_2TCM.h"
+
+#include <fabber_core/fwdmodel.h>
+
+#include <armawrap/newmat.h>
+
+#include <string>
+#include <vector>
+
+
+class PET_2TCM_DI_FwdModel : public PET_2TCM_FwdModel
+{
+public:
+    static FwdModel *NewInstance();
+
+    PET_2TCM_DI_FwdModel()
+    {
+    }
+
+    std::string GetDescription() const;
+    void GetOptions(std::vector<OptionSpec> &opts) const;
+    void Initialize(FabberRunData &rundata);
+    void GetParameterDefaults(std::vector<Parameter> &params) const;
+    void EvaluateBatch(const NEWMAT::Matrix &params, NEWMAT::Matrix &results) const;
+
+protected:
+    void Evaluate(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result) const;
+
+private:
+    double m_init_fA;
+
+    /** Auto-register with forward model factory. */
+    static FactoryRegistration<FwdModelFactory, PET_2TCM_DI_FwdModel> registration;
+};
@@ -62,12 +62,14 @@ void PET_2TCM_IR_FwdModel::GetParameterDefaults(
   int p = params.size();
 
   // specific parameters
-  params.push_back(Parameter(p++, "K1", DistParams(m_init_K1, 100),
-                             DistParams(m_init_K1, 100), PRIOR_NORMAL,
-                             TRANSFORM_LOG()));
-  params.push_back(Parameter(p++, "Ki", DistParams(m_init_Ki, 100),
-                             DistParams(m_init_Ki, 100), PRIOR_NORMAL,
-                             TRANSFORM_LOG()));
+  if (!m_varpro) {
+    params.push_back(Parameter(p++, "K1", DistParams(m_init_K1, 100),
+                               DistParams(m_init_K1, 100), PRIOR_NORMAL,
+                               TRANSFORM_LOG()));
+    params.push_back(Parameter(p++, "Ki", DistParams(m_init_Ki, 100),
+                               DistParams(m_init_Ki, 100), PRIOR_NORMAL,
+                               TRANSFORM_LOG()));
+  }
   params.push_back(Parameter(p++, "k_sum", DistParams(m_init_k_sum, 100),
                              DistParams(m_init_k_sum, 100), PRIOR_NORMAL,
                              TRANSFORM_LOG()));
@@ -80,25 +82,79 @@ void PET_2TCM_IR_FwdModel::EvaluateModel(const ColumnVector &params,
   if (key == "") {
     Evaluate(params, result);
   } else {
+    ColumnVector full = FullParams(params);
     result.ReSize(1);
-    result(1) = params(3) * 6000 / m_density * m_ca / 18.0156 / m_lc;
+    if (key == "vB") {
+      result(1) = full(1);
+    } else if (key == "K1") {
+      result(1) = full(2);
+    } else if (key == "Ki") {
+      result(1) = full(3);
+    } else {
+      result(1) = full(3) * 6000 / m_density * m_ca / 18.0156 / m_lc;
+    }
   }
 }
 
+void PET_2TCM_IR_FwdModel::EvaluateBatch(const Matrix &params,
+                                         Matrix &results) const {
+  if (m_varpro) {
+    PETFwdModel::EvaluateBatch(params, results);
+    return;
+  }
+
+  // Kernels of all columns are convolved in one operator product
+  ColumnVector k_sum = params.Row(4).t();
+  Matrix kernels = ExpKernels(k_sum);
+  Matrix conv_1 = ConvolveBatch(kernels);
+  Matrix complement = 1 - kernels;
+  Matrix conv_2 = ConvolveBatch(complement);
+
+  results.ReSize(m_aif_pet.Nrows(), params.Ncols());
+  for (int s = 1; s <= params.Ncols(); s++) {
+    double vB = params(1, s);
+    double K1 = params(2, s);
+    double Ki = params(3, s);
+    results.Column(s) = (1 - vB) * (K1 * conv_1.Column(s) + Ki * conv_2.Column(s)) +
+                        vB * m_aif_pet;
+  }
+}
+
+ColumnVector PET_2TCM_IR_FwdModel::FullParams(const ColumnVector &params) const {
+  if (!m_varpro) {
+    return params;
+  }
+
+  // Only k_sum is inferred, vB, K1 and Ki follow from a linear fit
+  double k_sum = params(1);
+  Matrix basis(m_aif_pet.Nrows(), 3);
+  basis.Column(1) = ConvolveExp(k_sum);
+  basis.Column(2) = ConvolveExpComplement(k_sum);
+  basis.Column(3) = m_aif_pet;
+  ColumnVector coefs = solve_linear_vb(basis, data);
+
+  double vB = coefs(3);
+  ColumnVector full(4);
+  full(1) = vB;
+  full(2) = coefs(1) / (1 - vB);
+  full(3) = coefs(2) / (1 - vB);
+  full(4) = k_sum;
+  return full;
+}
+
 void PET_2TCM_IR_FwdModel::Evaluate(const ColumnVector &params,
                                     ColumnVector &result) const {
   // Parameters that are inferred - extract and give sensible names
+  ColumnVector full = FullParams(params);
   int p = 1;
 
-  double vB = params(p++);
-  double K1 = params(p++);
-  double Ki = params(p++);
-  double k_sum = params(p++);
-
-  ColumnVector exp_results = MISCMATHS::exp(-k_sum * m_kernel_time);
+  double vB = full(p++);
+  double K1 = full(p++);
+  double Ki = full(p++);
+  double k_sum = full(p++);
 
-  ColumnVector convolution_result_1 = m_c_mat * exp_results;
-  ColumnVector convolution_result_2 = m_c_mat * (1 - exp_results);
+  ColumnVector convolution_result_1 = ConvolveExp(k_sum);
+  ColumnVector convolution_result_2 = ConvolveExpComplement(k_sum);
 
   ColumnVector c_1 = K1 * convolution_result_1;
   ColumnVector c_2 = Ki * convolution_result_2;
@@ -121,6 +177,11 @@ void PET_2TCM_IR_FwdModel::GetOutputs(std::vector<std::string> &outputs) const {
   if (m_ca != 0) {
     outputs.push_back("CMRglc");
   }
+  if (m_varpro) {
+    outputs.push_back("vB");
+    outputs.push_back("K1");
+    outputs.push_back("Ki");
+  }
 }
 
 FwdModel *PET_2TCM_IR_FwdModel::NewInstance() {
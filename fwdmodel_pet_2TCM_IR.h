@@ -28,10 +28,12 @@ public:
     void Initialize(FabberRunData &rundata);
     void GetParameterDefaults(std::vector<Parameter> &params) const;
     void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result, const std::string &key = "") const;
+    void EvaluateBatch(const NEWMAT::Matrix &params, NEWMAT::Matrix &results) const;
     void GetOutputs(std::vector<std::string> &outputs) const;
 
 protected:
      void Evaluate(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result) const;
+     NEWMAT::ColumnVector FullParams(const NEWMAT::ColumnVector &params) const;
 
 private:
     // Initial values of model parameters - always inferred
@@ -0,0 +1,203 @@
+/**
+ * pet_checkpoint.cc
+ *
+ * Binary checkpoint of completed voxel chunks so that an interrupted
+ * fabber_pet run only has to fit the voxels it had not finished.
+ */
+
+#include "pet_checkpoint.h"
+
+#include <fabber_core/rundata.h>
+
+#include <armawrap/newmat.h>
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+using namespace std;
+using namespace NEWMAT;
+
+static const char MAGIC[8] = { 'P', 'E', 'T', 'C', 'K', 'P', 'T', '1' };
+static const uint32_t RECORD_END = 0x50455445;
+
+template <class T>
+static void write_value(ostream &out, T value)
+{
+    out.write((const char *)&value, sizeof(T));
+}
+
+static uint64_t hash_bytes(const void *data, size_t size, uint64_t hash)
+{
+    // FNV-1a
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++){
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+template <class T>
+static bool read_value(istream &in, T &value)
+{
+    return (bool)in.read((char *)&value, sizeof(T));
+}
+
+PETCheckpoint::PETCheckpoint(const std::string &filename, uint64_t options_hash)
+    : m_filename(filename)
+{
+    ifstream in(m_filename.c_str(), ios::binary);
+    if (!in){
+        ofstream out(m_filename.c_str(), ios::binary | ios::trunc);
+        out.write(MAGIC, sizeof(MAGIC));
+        write_value<uint64_t>(out, options_hash);
+        if (!out){
+            throw InvalidOptionValue("checkpoint", filename, "Could not create checkpoint file");
+        }
+        return;
+    }
+
+    char magic[sizeof(MAGIC)];
+    uint64_t file_options_hash;
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+        || !read_value(in, file_options_hash)){
+        throw InvalidOptionValue("checkpoint", filename, "Not a fabber_pet checkpoint file");
+    }
+    if (file_options_hash != options_hash){
+        throw InvalidOptionValue("checkpoint", filename,
+                                 "Checkpoint was written with different options - remove it to start again");
+    }
+
+    // Index the complete records, anything after the last one is discarded
+    streamoff end = in.tellg();
+    uint64_t input_hash;
+    int chunk;
+    PETVoxelOutputs outputs;
+    while (ReadRecord(in, input_hash, chunk, outputs)){
+        m_index[input_hash].push_back(make_pair(chunk, end));
+        end = in.tellg();
+    }
+    in.close();
+    if (truncate(m_filename.c_str(), end) != 0){
+        throw InvalidOptionValue("checkpoint", filename, "Could not truncate incomplete checkpoint record");
+    }
+}
+
+bool PETCheckpoint::ReadRecord(istream &in, uint64_t &input_hash, int &chunk, PETVoxelOutputs &outputs) const
+{
+    int32_t c, n_outputs;
+    if (!read_value(in, input_hash) || !read_value(in, c) || !read_value(in, n_outputs)){
+        return false;
+    }
+    chunk = c;
+
+    outputs.data.clear();
+    outputs.types.clear();
+    for (int i = 0; i < n_outputs; i++){
+        int32_t len, type, rows, cols;
+        if (!read_value(in, len) || len < 0){
+            return false;
+        }
+        string name(len, ' ');
+        if (!in.read(&name[0], len) || !read_value(in, type) || !read_value(in, rows)
+            || !read_value(in, cols) || rows < 0 || cols < 0){
+            return false;
+        }
+
+        Matrix &m = outputs.data[name];
+        m.ReSize(rows, cols);
+        for (int r = 1; r <= rows; r++){
+            for (int col = 1; col <= cols; col++){
+                double value;
+                if (!read_value(in, value)){
+                    return false;
+                }
+                m(r, col) = value;
+            }
+        }
+        outputs.types[name] = (VoxelDataType)type;
+    }
+
+    uint32_t end;
+    return read_value(in, end) && end == RECORD_END;
+}
+
+void PETCheckpoint::Load(uint64_t input_hash, std::map<int, PETVoxelOutputs> &chunks)
+{
+    lock_guard<mutex> lock(m_mutex);
+    chunks.clear();
+
+    ifstream in(m_filename.c_str(), ios::binary);
+    const vector<pair<int, streamoff> > &records = m_index[input_hash];
+    for (size_t i = 0; i < records.size(); i++){
+        uint64_t hash;
+        int chunk;
+        in.seekg(records[i].second);
+        if (!ReadRecord(in, hash, chunk, chunks[records[i].first])){
+            throw InvalidOptionValue("checkpoint", m_filename, "Checkpoint record could not be read");
+        }
+    }
+}
+
+void PETCheckpoint::Save(uint64_t input_hash, int chunk, const PETVoxelOutputs &outputs)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    ofstream out(m_filename.c_str(), ios::binary | ios::app);
+    out.seekp(0, ios::end);
+    streamoff offset = out.tellp();
+    write_value<uint64_t>(out, input_hash);
+    write_value<int32_t>(out, chunk);
+    write_value<int32_t>(out, outputs.data.size());
+
+    map<string, Matrix>::const_iterator it;
+    for (it = outputs.data.begin(); it != outputs.data.end(); ++it){
+        const Matrix &m = it->second;
+        write_value<int32_t>(out, it->first.size());
+        out.write(it->first.data(), it->first.size());
+        write_value<int32_t>(out, outputs.types.find(it->first)->second);
+        write_value<int32_t>(out, m.Nrows());
+        write_value<int32_t>(out, m.Ncols());
+        for (int r = 1; r <= m.Nrows(); r++){
+            for (int c = 1; c <= m.Ncols(); c++){
+                write_value<double>(out, m(r, c));
+            }
+        }
+    }
+    write_value<uint32_t>(out, RECORD_END);
+    out.flush();
+    if (!out){
+        throw InvalidOptionValue("checkpoint", m_filename, "Could not write checkpoint record");
+    }
+    m_index[input_hash].push_back(make_pair(chunk, offset));
+}
+
+uint64_t PETCheckpoint::Hash(const std::string &value, uint64_t hash)
+{
+    return hash_bytes(value.data(), value.size(), hash);
+}
+
+uint64_t PETCheckpoint::HashFile(const std::string &filename, uint64_t hash)
+{
+    ifstream in(filename.c_str(), ios::binary);
+    if (!in){
+        throw FabberRunDataError("Could not read file: " + filename);
+    }
+    ostringstream contents;
+    contents << in.rdbuf();
+    return Hash(contents.str(), hash);
+}
+
+uint64_t PETCheckpoint::Hash(const Matrix &value, uint64_t hash)
+{
+    hash = Hash(to_string(value.Nrows()) + "x" + to_string(value.Ncols()), hash);
+    for (int r = 1; r <= value.Nrows(); r++){
+        for (int c = 1; c <= value.Ncols(); c++){
+            double v = value(r, c);
+            hash = hash_bytes(&v, sizeof(v), hash);
+        }
+    }
+    return hash;
+}
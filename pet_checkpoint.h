@@ -0,0 +1,59 @@
+/**
+ * pet_checkpoint.h
+ *
+ * Binary checkpoint of completed voxel chunks so that an interrupted
+ * fabber_pet run only has to fit the voxels it had not finished.
+ */
+
+#pragma once
+
+#include "pet_driver.h"
+
+#include <armawrap/newmat.h>
+
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Checkpoint file of chunk outputs
+ *
+ * The file starts with a hash of the fabber options and holds one record
+ * per completed chunk, tagged with a hash of the voxel data the chunk was
+ * fitted from. Records are appended as chunks complete, and a record left
+ * incomplete by a crash is discarded when the file is reopened.
+ */
+class PETCheckpoint
+{
+public:
+    /**
+     * Open a checkpoint, creating it if it does not exist
+     *
+     * @throw InvalidOptionValue if the file was written with other options
+     */
+    PETCheckpoint(const std::string &filename, uint64_t options_hash);
+
+    /** Get the chunks stored for a fit of the given inputs */
+    void Load(uint64_t input_hash, std::map<int, PETVoxelOutputs> &chunks);
+
+    /** Append the outputs of a completed chunk. Safe to call from worker threads */
+    void Save(uint64_t input_hash, int chunk, const PETVoxelOutputs &outputs);
+
+    static uint64_t Hash(const std::string &value, uint64_t hash = HASH_SEED);
+    static uint64_t Hash(const NEWMAT::Matrix &value, uint64_t hash = HASH_SEED);
+    static uint64_t HashFile(const std::string &filename, uint64_t hash = HASH_SEED);
+    static const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+private:
+    bool ReadRecord(std::istream &in, uint64_t &input_hash, int &chunk, PETVoxelOutputs &outputs) const;
+
+    std::string m_filename;
+    std::mutex m_mutex;
+
+    // Offset of each stored chunk, by input hash
+    std::map<uint64_t, std::vector<std::pair<int, std::streamoff> > > m_index;
+};
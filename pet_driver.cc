@@ -0,0 +1,958 @@
+/**
+ * pet_driver.cc
+ *
+ * Execution modes of the fabber_pet executable which go beyond a single
+ * fabber run, e.g. incremental fitting while frames are still arriving.
+ */
+
+#include "pet_driver.h"
+#include "pet_checkpoint.h"
+#include "pet_slab_io.h"
+#include "pet_work_queue.h"
+#include "fwdmodel_pet.h"
+
+#include <fabber_core/easylog.h>
+#include <fabber_core/fabber_core.h>
+#include <fabber_core/inference.h>
+#include <fabber_core/rundata_newimage.h>
+
+#include <miscmaths/miscmaths.h>
+#include <newimage/newimageall.h>
+#include <armawrap/newmat.h>
+
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+using namespace NEWMAT;
+using MISCMATHS::read_ascii_matrix;
+
+static OptionSpec OPTIONS[] = {
+    { "driver-help", OPT_BOOL, "Show the fabber_pet driver options", OPT_NONREQ, "" },
+    { "threads", OPT_INT,
+        "Fit voxels in parallel chunks on this many threads (0 for one per core). Needs a voxelwise method",
+        OPT_NONREQ, "1" },
+    { "chunk-size", OPT_INT, "Number of voxels in each chunk of a parallel fit", OPT_NONREQ, "64" },
+    { "checkpoint", OPT_FILE,
+        "Save completed chunks to this file and, when it exists, resume from it without refitting them",
+        OPT_NONREQ, "" },
+    { "compare-models", OPT_STR,
+        "Comma separated models to fit in one pass, e.g. pet_1TCM,pet_2TCM,pet_2TCM_IR. Saves free energy "
+        "and AIC maps of each model, the winning model (1-based) and its outputs as winner_*",
+        OPT_NONREQ, "" },
+    { "compare-criterion", OPT_STR, "Criterion used to pick the winning model (fe or aic)", OPT_NONREQ,
+        "fe" },
+    { "slab-size", OPT_INT,
+        "Stream the 4D data in slabs of this many z planes, writing outputs as uncompressed NIfTI after each "
+        "slab. The data must be uncompressed .nii",
+        OPT_NONREQ, "" },
+    { "incremental", OPT_BOOL,
+        "Refit as new frames and blood samples arrive, warm-starting each update from the previous posterior",
+        OPT_NONREQ, "" },
+    { "incremental-frames", OPT_INT, "Total number of frames in the acquisition (stop once all are fitted)",
+        OPT_NONREQ, "0" },
+    { "incremental-poll", OPT_FLOAT, "Interval between checks for new frames (s)", OPT_NONREQ, "2" },
+    { "incremental-timeout", OPT_FLOAT, "Stop when no new frame has arrived for this long (s)",
+        OPT_NONREQ, "600" },
+    { "incremental-iterations", OPT_INT, "Maximum iterations of each warm-started update", OPT_NONREQ,
+        "3" },
+    { "screen", OPT_BOOL,
+        "Skip the fit of background voxels which fail a cheap pre-screen. Skipped voxels get the prior mean "
+        "of each parameter and zero for other outputs. Saves the screen map (0 fitted, 1 low activity, "
+        "2 negative curve, 3 low SNR)", OPT_NONREQ, "" },
+    { "screen-activity", OPT_FLOAT,
+        "Skip voxels whose area under the TAC is below this fraction of the area under the AIF",
+        OPT_NONREQ, "0.01" },
+    { "screen-negative", OPT_FLOAT, "Skip voxels with more than this fraction of negative frames",
+        OPT_NONREQ, "0.5" },
+    { "screen-snr", OPT_FLOAT,
+        "Skip voxels whose SNR against a fit of the blood and integrated blood curves is below this",
+        OPT_NONREQ, "2" },
+    { "" },
+};
+
+void PETRunData::SaveVoxelData(const std::string &filename, NEWMAT::Matrix &data,
+                               VoxelDataType data_type)
+{
+    outputs.data[filename] = data;
+    outputs.types[filename] = data_type;
+}
+
+PETDriver::PETDriver(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++){
+        string arg = argv[i];
+
+        // Options in the driver table are consumed, everything else is for fabber
+        bool driver_option = false;
+        if (i > 0 && arg.substr(0, 2) == "--"){
+            string key = arg.substr(2, arg.find('=') - 2);
+            for (int j = 0; OPTIONS[j].name != ""; j++){
+                if (OPTIONS[j].name == key){
+                    driver_option = true;
+                    size_t eq = arg.find('=');
+                    m_options[key] = (eq == string::npos) ? "" : arg.substr(eq + 1);
+                }
+            }
+        }
+        if (!driver_option){
+            m_args.push_back(arg);
+        }
+    }
+}
+
+PETDriver::~PETDriver()
+{
+}
+
+int PETDriver::Execute()
+{
+    if (HaveOption("driver-help")){
+        Usage();
+        return 0;
+    }
+
+    if (!HaveOption("incremental") && !HaveOption("threads") && !HaveOption("slab-size")
+        && !HaveOption("checkpoint") && !HaveOption("compare-models") && !HaveOption("screen")){
+        // Standard fabber run
+        vector<string> args = m_args;
+        vector<char *> argv;
+        for (size_t i = 0; i < args.size(); i++){
+            argv.push_back(&args[i][0]);
+        }
+        return execute(argv.size(), &argv[0]);
+    }
+
+    EasyLog log;
+    try{
+        FabberRunDataNewimage io;
+        ParseArgs(io);
+        log.StartLog(io.GetOutputDir());
+        SetLogger(&log);
+        io.SetLogger(&log);
+
+        if (HaveOption("checkpoint")){
+            // Any change to the fabber options invalidates the checkpoint
+            uint64_t options_hash = PETCheckpoint::HASH_SEED;
+            for (size_t i = 1; i < m_args.size(); i++){
+                options_hash = PETCheckpoint::Hash(m_args[i] + "\n", options_hash);
+
+                // Including options read from a file
+                string optfile;
+                if ((m_args[i] == "-f" || m_args[i] == "-@") && i + 1 < m_args.size()){
+                    optfile = m_args[i + 1];
+                } else if (m_args[i].substr(0, 10) == "--optfile="){
+                    optfile = m_args[i].substr(10);
+                }
+                if (optfile != ""){
+                    options_hash = PETCheckpoint::HashFile(optfile, options_hash);
+                }
+            }
+            options_hash = PETCheckpoint::Hash(GetOption("compare-models", ""), options_hash);
+            m_checkpoint.reset(new PETCheckpoint(GetOption("checkpoint", ""), options_hash));
+        }
+
+        Run(io);
+
+        log.StopLog();
+        cout << "Final logfile: " << io.GetOutputDir() << "/logfile" << endl;
+        return 0;
+    }
+    catch (const exception &e){
+        cerr << "Exception: " << e.what() << endl;
+    }
+    return 1;
+}
+
+void PETDriver::Usage() const
+{
+    cout << "fabber_pet driver options:" << endl << endl;
+    for (int i = 0; OPTIONS[i].name != ""; i++){
+        cout << "  --" << OPTIONS[i].name;
+        if (OPTIONS[i].def != ""){
+            cout << " [default " << OPTIONS[i].def << "]";
+        }
+        cout << endl << "      " << OPTIONS[i].description << endl;
+    }
+}
+
+void PETDriver::Run(FabberRunData &io)
+{
+    if (HaveOption("incremental")){
+        // Each update refits the whole acquisition so far with one model
+        if (HaveOption("compare-models")){
+            throw InvalidOptionValue("compare-models", GetOption("compare-models", ""),
+                                     "Not supported with incremental fitting");
+        }
+        if (HaveOption("slab-size")){
+            throw InvalidOptionValue("slab-size", GetOption("slab-size", ""),
+                                     "Not supported with incremental fitting");
+        }
+        if (HaveOption("checkpoint")){
+            throw InvalidOptionValue("checkpoint", GetOption("checkpoint", ""),
+                                     "Not supported with incremental fitting");
+        }
+        RunIncremental(io);
+    } else if (HaveOption("compare-models")){
+        if (HaveOption("slab-size")){
+            throw InvalidOptionValue("slab-size", GetOption("slab-size", ""),
+                                     "Not supported with model comparison");
+        }
+        RunCompare(io);
+    } else if (HaveOption("slab-size")){
+        RunSlabs(io);
+    } else{
+        RunParallel(io);
+    }
+}
+
+void PETDriver::RunParallel(FabberRunData &io)
+{
+    CheckVoxelwise(io);
+
+    vector<PETModelSet> models;
+    CreateModels(io, vector<string>(1, io.GetString("model")), models);
+
+    vector<PETVoxelOutputs> outputs;
+    FitVoxels(io, io.GetMainVoxelData(), io.GetVoxelCoords(), models, map<string, Matrix>(),
+              map<string, string>(), outputs);
+    SaveOutputs(outputs[0], io);
+}
+
+void PETDriver::RunSlabs(FabberRunData &io)
+{
+    CheckVoxelwise(io);
+
+    int slab_size = max(1, GetIntOption("slab-size", 16));
+    PETSlabReader reader(io.GetString("data"), io.GetStringDefault("mask", ""));
+    PETSlabWriter writer(io.GetOutputDir(), reader.Header());
+
+    vector<PETModelSet> models;
+    CreateModels(io, vector<string>(1, io.GetString("model")), models);
+
+    // Slabs only cover the extent of the mask
+    vector<int> starts;
+    for (int z = reader.FirstSlice(); z >= 0 && z <= reader.LastSlice(); z += slab_size){
+        starts.push_back(z);
+    }
+
+    struct Slab
+    {
+        Matrix data;
+        Matrix coords;
+    };
+    auto read_slab = [&](size_t s) {
+        Slab slab;
+        reader.ReadSlab(starts[s], min(starts[s] + slab_size - 1, reader.LastSlice()), slab.data,
+                        slab.coords);
+        return slab;
+    };
+
+    future<Slab> next;
+    if (!starts.empty()){
+        next = async(launch::async, read_slab, 0);
+    }
+    for (size_t s = 0; s < starts.size(); s++){
+        Slab slab = next.get();
+
+        // Read the next slab while this one is fitted
+        if (s + 1 < starts.size()){
+            next = async(launch::async, read_slab, s + 1);
+        }
+
+        int z0 = starts[s];
+        int z1 = min(z0 + slab_size - 1, reader.LastSlice());
+        if (slab.data.Ncols() == 0){
+            continue;
+        }
+
+        vector<PETVoxelOutputs> outputs;
+        FitVoxels(io, slab.data, slab.coords, models, map<string, Matrix>(), map<string, string>(),
+                  outputs);
+        map<string, Matrix>::iterator it;
+        for (it = outputs[0].data.begin(); it != outputs[0].data.end(); ++it){
+            writer.Write(it->first, it->second, slab.coords, z0, z1);
+        }
+
+        LOG << "PETDriver::RunSlabs - fitted slices " << z0 << "-" << z1 << " ("
+            << slab.data.Ncols() << " voxels)" << endl;
+    }
+}
+
+void PETDriver::RunCompare(FabberRunData &io)
+{
+    CheckVoxelwise(io);
+
+    vector<string> names;
+    istringstream list(GetOption("compare-models", ""));
+    string name;
+    while (getline(list, name, ',')){
+        if (name != ""){
+            names.push_back(name);
+        }
+    }
+    if (names.size() < 2){
+        throw InvalidOptionValue("compare-models", GetOption("compare-models", ""),
+                                 "Give at least two models separated by commas");
+    }
+    string method = io.GetStringDefault("method", "vb");
+    if (method != "vb"){
+        throw InvalidOptionValue("method", method, "Model comparison needs the free energy of a VB fit");
+    }
+    if (io.GetBool("varpro")){
+        // Solved linear parameters are not counted by the AIC penalty and
+        // make the free energy data dependent
+        throw InvalidOptionValue("varpro", "", "Not supported with model comparison");
+    }
+    string criterion = GetOption("compare-criterion", "fe");
+    if (criterion != "fe" && criterion != "aic"){
+        throw InvalidOptionValue("compare-criterion", criterion, "Must be fe or aic");
+    }
+
+    // Data and operators are loaded once for all models
+    vector<PETModelSet> models;
+    CreateModels(io, names, models);
+    const Matrix &data = io.GetMainVoxelData();
+
+    map<string, string> options;
+    options["save-mean"] = "";
+    options["save-model-extras"] = "";
+    options["save-free-energy"] = "";
+    options["save-model-fit"] = "";
+    vector<PETVoxelOutputs> outputs;
+    FitVoxels(io, data, io.GetVoxelCoords(), models, map<string, Matrix>(), options, outputs);
+
+    int n_voxels = data.Ncols();
+    int n_frames = data.Nrows();
+    PETVoxelOutputs compare;
+    Matrix score(names.size(), n_voxels);
+    for (size_t m = 0; m < names.size(); m++){
+        vector<Parameter> params;
+        models[0][m]->GetParameterDefaults(params);
+
+        // AIC from the residual sum of squares of the model fit
+        Matrix &fe = outputs[m].data["freeEnergy"];
+        Matrix &fit = outputs[m].data["modelfit"];
+        Matrix aic(1, n_voxels);
+        for (int v = 1; v <= n_voxels; v++){
+            double ssr = (data.Column(v) - fit.Column(v)).SumSquare();
+            aic(1, v) = n_frames * log(ssr / n_frames) + 2 * params.size();
+        }
+
+        compare.data["freeEnergy_" + names[m]] = fe;
+        compare.types["freeEnergy_" + names[m]] = VDT_SCALAR;
+        compare.data["aic_" + names[m]] = aic;
+        compare.types["aic_" + names[m]] = VDT_SCALAR;
+        if (criterion == "fe"){
+            score.Row(m + 1) = fe.Row(1);
+        } else{
+            score.Row(m + 1) = -aic.Row(1);
+        }
+    }
+
+    // Higher free energy or lower AIC wins
+    Matrix winner(1, n_voxels);
+    for (int v = 1; v <= n_voxels; v++){
+        int best = 1;
+        for (size_t m = 2; m <= names.size(); m++){
+            if (score(m, v) > score(best, v)){
+                best = m;
+            }
+        }
+        winner(1, v) = best;
+    }
+
+    // No model wins in voxels skipped by the pre-screen
+    if (outputs[0].data.find("screen") != outputs[0].data.end()){
+        Matrix &screen = outputs[0].data["screen"];
+        for (int v = 1; v <= n_voxels; v++){
+            if (screen(1, v) != 0){
+                winner(1, v) = 0;
+            }
+        }
+        compare.data["screen"] = screen;
+        compare.types["screen"] = VDT_SCALAR;
+    }
+    compare.data["winner"] = winner;
+    compare.types["winner"] = VDT_SCALAR;
+
+    // Means of the winning model, zero where it does not have that output
+    for (size_t m = 0; m < names.size(); m++){
+        map<string, Matrix>::iterator it;
+        for (it = outputs[m].data.begin(); it != outputs[m].data.end(); ++it){
+            if (it->first.substr(0, 5) != "mean_"){
+                continue;
+            }
+            Matrix &merged = compare.data["winner_" + it->first];
+            if (merged.Nrows() < it->second.Nrows()){
+                Matrix grown(it->second.Nrows(), n_voxels);
+                grown = 0.0;
+                if (merged.Nrows() > 0){
+                    grown.Rows(1, merged.Nrows()) = merged;
+                }
+                merged = grown;
+            }
+            compare.types["winner_" + it->first] = outputs[m].types[it->first];
+            for (int v = 1; v <= n_voxels; v++){
+                if (winner(1, v) == m + 1){
+                    merged.SubMatrix(1, it->second.Nrows(), v, v) = it->second.Column(v);
+                }
+            }
+        }
+    }
+
+    SaveOutputs(compare, io);
+}
+
+void PETDriver::RunIncremental(FabberRunData &io)
+{
+    CheckVoxelwise(io);
+    if (HaveOption("screen")){
+        // Skipped voxels would have no posterior to warm-start from
+        throw InvalidOptionValue("screen", "", "Not supported with incremental fitting");
+    }
+
+    int n_frames_total = GetIntOption("incremental-frames", 0);
+    double poll = GetDoubleOption("incremental-poll", 2);
+    double timeout = GetDoubleOption("incremental-timeout", 600);
+    int warm_its = GetIntOption("incremental-iterations", 3);
+
+    string pet_time_path = io.GetString("pet-time-data");
+    string aif_path = io.GetString("aif-data");
+    string aif_time_path = io.GetStringDefault("aif-time-data", "");
+    string data_path = io.GetString("data");
+
+    vector<PETModelSet> models;
+    Matrix mvn;
+    int n_done = 0;
+    double waited = 0;
+    while (n_frames_total == 0 || n_done < n_frames_total){
+
+        // Timing files and the 4D data grow as frames are reconstructed
+        ColumnVector pet_time = read_ascii_matrix(pet_time_path);
+        ColumnVector aif = read_ascii_matrix(aif_path);
+        ColumnVector aif_time;
+
+        // Only the header is read until there is something new to fit
+        NEWIMAGE::volume4D<float> hdr;
+        NEWIMAGE::read_volume4D_hdr_only(hdr, data_path);
+
+        // Only fit frames which the blood samples already cover
+        int n_frames = min(pet_time.Nrows(), hdr.tsize());
+        if (aif_time_path != ""){
+            aif_time = read_ascii_matrix(aif_time_path);
+            while (n_frames > 0 && pet_time(n_frames) > aif_time.Maximum()){
+                n_frames--;
+            }
+        } else{
+            n_frames = min(n_frames, aif.Nrows());
+        }
+
+        if (n_frames <= n_done || n_frames < 2){
+            if (waited >= timeout){
+                LOG << "PETDriver::RunIncremental - no new frames after " << timeout << "s, stopping" << endl;
+                break;
+            }
+            this_thread::sleep_for(chrono::duration<double>(poll));
+            waited += poll;
+            continue;
+        }
+        waited = 0;
+
+        FabberRunDataNewimage frame_io;
+        ParseArgs(frame_io);
+        frame_io.SetLogger(GetLogger());
+        const Matrix &data = frame_io.GetMainVoxelData();
+        if (data.Nrows() < n_frames){
+            // The file may still grow after the header was read, but not shrink
+            throw FabberRunDataError("4D data has fewer frames than its header: " + data_path);
+        }
+
+        // Operators are built once then extended in place
+        if (n_done == 0){
+            CreateModels(frame_io, vector<string>(1, frame_io.GetString("model")), models);
+            if (!dynamic_cast<PETFwdModel *>(models[0][0].get())){
+                throw InvalidOptionValue("model", frame_io.GetString("model"),
+                                         "Incremental fitting needs one of the PET models");
+            }
+        }
+        ColumnVector frame_time = pet_time.Rows(1, n_frames);
+        for (size_t i = 0; i < models.size(); i++){
+            dynamic_cast<PETFwdModel *>(models[i][0].get())->UpdateTimings(frame_time, aif, aif_time);
+        }
+
+        map<string, Matrix> voxel_inputs;
+        map<string, string> options;
+        options["save-mvn"] = "";
+        if (n_done > 0){
+            voxel_inputs["pet-incremental-mvn"] = mvn;
+            options["continue-from-mvn"] = "pet-incremental-mvn";
+            options["max-iterations"] = to_string(warm_its);
+        }
+
+        vector<PETVoxelOutputs> outputs;
+        Matrix frames = data.Rows(1, n_frames);
+        FitVoxels(io, frames, frame_io.GetVoxelCoords(), models, voxel_inputs, options, outputs);
+        mvn = outputs[0].data["finalMVN"];
+        SaveOutputs(outputs[0], io);
+
+        LOG << "PETDriver::RunIncremental - updated fit with " << n_frames << " frames" << endl;
+        n_done = n_frames;
+    }
+}
+
+void PETDriver::FitVoxels(FabberRunData &io, const Matrix &data, const Matrix &coords,
+                          vector<PETModelSet> &models, const map<string, Matrix> &voxel_inputs,
+                          const map<string, string> &options, vector<PETVoxelOutputs> &outputs)
+{
+    if (!HaveOption("screen")){
+        FitChunks(io, data, coords, models, voxel_inputs, options, outputs);
+        return;
+    }
+
+    int n_voxels = data.Ncols();
+    Matrix screen;
+    ScreenVoxels(models[0], data, screen);
+    vector<int> kept;
+    for (int v = 1; v <= n_voxels; v++){
+        if (screen(1, v) == 0){
+            kept.push_back(v);
+        }
+    }
+    LOG << "PETDriver::FitVoxels - pre-screen skipped " << n_voxels - kept.size() << " of " << n_voxels
+        << " voxels" << endl;
+
+    // Only the voxels which passed are fitted
+    int n_kept = kept.size();
+    Matrix kept_data(data.Nrows(), n_kept);
+    Matrix kept_coords(coords.Nrows(), n_kept);
+    map<string, Matrix> kept_inputs;
+    for (int k = 1; k <= n_kept; k++){
+        kept_data.Column(k) = data.Column(kept[k - 1]);
+        kept_coords.Column(k) = coords.Column(kept[k - 1]);
+    }
+    map<string, Matrix>::const_iterator input;
+    for (input = voxel_inputs.begin(); input != voxel_inputs.end(); ++input){
+        Matrix &kept_input = kept_inputs[input->first];
+        kept_input.ReSize(input->second.Nrows(), n_kept);
+        for (int k = 1; k <= n_kept; k++){
+            kept_input.Column(k) = input->second.Column(kept[k - 1]);
+        }
+    }
+    vector<PETVoxelOutputs> kept_outputs;
+    FitChunks(io, kept_data, kept_coords, models, kept_inputs, options, kept_outputs);
+
+    // Skipped voxels get the prior mean of each parameter and zero otherwise.
+    // The outputs are set up without the fit, which may have had no voxels
+    int n_models = models[0].size();
+    outputs.assign(n_models, PETVoxelOutputs());
+    for (int m = 0; m < n_models; m++){
+        SkippedOutputs(io, models[0][m].get(), options, data.Nrows(), n_voxels, outputs[m]);
+
+        map<string, Matrix>::iterator it;
+        for (it = kept_outputs[m].data.begin(); it != kept_outputs[m].data.end(); ++it){
+            Matrix &full = outputs[m].data[it->first];
+            if (full.Nrows() != it->second.Nrows() || full.Ncols() != n_voxels){
+                full.ReSize(it->second.Nrows(), n_voxels);
+                full = 0.0;
+            }
+            for (int k = 1; k <= n_kept; k++){
+                full.Column(kept[k - 1]) = it->second.Column(k);
+            }
+            outputs[m].types[it->first] = kept_outputs[m].types[it->first];
+        }
+        outputs[m].data["screen"] = screen;
+        outputs[m].types["screen"] = VDT_SCALAR;
+    }
+}
+
+void PETDriver::SkippedOutputs(FabberRunData &io, FwdModel *model,
+                               const map<string, string> &options, int n_frames, int n_voxels,
+                               PETVoxelOutputs &outputs) const
+{
+    auto saving = [&](const string &key) {
+        return options.find(key) != options.end() || io.GetBool(key);
+    };
+
+    vector<Parameter> params;
+    model->GetParameters(io, params);
+    ColumnVector prior_mean(params.size());
+    for (size_t p = 0; p < params.size(); p++){
+        prior_mean(p + 1) = params[p].prior.mean();
+    }
+
+    if (saving("save-mean") || io.GetStringDefault("method", "vb") == "pet_mcmc"){
+        for (size_t p = 0; p < params.size(); p++){
+            Matrix mean(1, n_voxels);
+            mean = prior_mean(p + 1);
+            outputs.data["mean_" + params[p].name] = mean;
+            outputs.types["mean_" + params[p].name] = VDT_SCALAR;
+        }
+    }
+    if (saving("save-model-fit")){
+        Matrix fit(n_frames, n_voxels);
+        fit = 0.0;
+        outputs.data["modelfit"] = fit;
+        outputs.types["modelfit"] = VDT_MULTIPLE;
+    }
+    if (saving("save-free-energy")){
+        Matrix fe(1, n_voxels);
+        fe = 0.0;
+        outputs.data["freeEnergy"] = fe;
+        outputs.types["freeEnergy"] = VDT_SCALAR;
+    }
+    if (saving("save-model-extras")){
+        // Sizes of the extra outputs, from the model at its prior mean
+        ColumnVector no_data(n_frames);
+        no_data = 0.0;
+        ColumnVector no_coords(3);
+        no_coords = 0.0;
+        model->PassData(1, no_data, no_coords);
+
+        vector<string> names;
+        model->GetOutputs(names);
+        for (size_t i = 0; i < names.size(); i++){
+            ColumnVector result;
+            model->EvaluateModel(prior_mean, result, names[i]);
+            Matrix extra(result.Nrows(), n_voxels);
+            extra = 0.0;
+            outputs.data[names[i]] = extra;
+            outputs.types[names[i]] = result.Nrows() > 1 ? VDT_MULTIPLE : VDT_SCALAR;
+        }
+    }
+}
+
+void PETDriver::ScreenVoxels(const PETModelSet &models, const Matrix &data, Matrix &screen) const
+{
+    PETFwdModel *model = dynamic_cast<PETFwdModel *>(models[0].get());
+    if (!model){
+        throw InvalidOptionValue("screen", "", "Pre-screening needs one of the PET models");
+    }
+    double min_activity = GetDoubleOption("screen-activity", 0.01);
+    double max_negative = GetDoubleOption("screen-negative", 0.5);
+    double min_snr = GetDoubleOption("screen-snr", 2);
+
+    Matrix stats;
+    model->SignalStatistics(data, stats);
+    screen.ReSize(1, data.Ncols());
+    for (int v = 1; v <= data.Ncols(); v++){
+        if (stats(1, v) < min_activity){
+            screen(1, v) = 1;
+        } else if (stats(3, v) > max_negative){
+            screen(1, v) = 2;
+        } else if (stats(2, v) < min_snr){
+            screen(1, v) = 3;
+        } else{
+            screen(1, v) = 0;
+        }
+    }
+}
+
+void PETDriver::FitChunks(FabberRunData &io, const Matrix &data, const Matrix &coords,
+                          vector<PETModelSet> &models, const map<string, Matrix> &voxel_inputs,
+                          const map<string, string> &options, vector<PETVoxelOutputs> &outputs)
+{
+    int n_voxels = data.Ncols();
+    int n_models = models[0].size();
+    int chunk_size = max(1, GetIntOption("chunk-size", 64));
+    int n_chunks = (n_voxels + chunk_size - 1) / chunk_size;
+    int n_workers = max(1, min((int)models.size(), n_chunks));
+    string output_dir = io.GetOutputDir();
+
+    vector<vector<PETVoxelOutputs> > chunk_outputs(n_chunks, vector<PETVoxelOutputs>(n_models));
+    vector<string> chunk_logs(n_chunks);
+
+    // Chunks completed by an earlier run with identical inputs are reused.
+    // Checkpoint records are numbered by chunk and model
+    uint64_t input_hash = 0;
+    map<int, PETVoxelOutputs> restored;
+    if (m_checkpoint){
+        input_hash = PETCheckpoint::Hash(data);
+        input_hash = PETCheckpoint::Hash(coords, input_hash);
+        input_hash = PETCheckpoint::Hash(to_string(chunk_size) + "/" + to_string(n_models), input_hash);
+        map<string, Matrix>::const_iterator input;
+        for (input = voxel_inputs.begin(); input != voxel_inputs.end(); ++input){
+            input_hash = PETCheckpoint::Hash(input->first, input_hash);
+            input_hash = PETCheckpoint::Hash(input->second, input_hash);
+        }
+        map<string, string>::const_iterator opt;
+        for (opt = options.begin(); opt != options.end(); ++opt){
+            input_hash = PETCheckpoint::Hash(opt->first + "=" + opt->second + "\n", input_hash);
+        }
+
+        // Blood curves and timing as loaded, so that input files corrected
+        // in place are not fitted with stale chunks
+        for (int m = 0; m < n_models; m++){
+            PETFwdModel *pet = dynamic_cast<PETFwdModel *>(models[0][m].get());
+            if (pet){
+                vector<ColumnVector> curves = pet->OperatorInputs();
+                for (size_t i = 0; i < curves.size(); i++){
+                    input_hash = PETCheckpoint::Hash(curves[i], input_hash);
+                }
+            }
+        }
+        m_checkpoint->Load(input_hash, restored);
+    }
+    vector<int> pending;
+    for (int c = 0; c < n_chunks; c++){
+        bool done = true;
+        for (int m = 0; m < n_models; m++){
+            done = done && restored.find(c * n_models + m) != restored.end();
+        }
+        if (!done){
+            pending.push_back(c);
+            continue;
+        }
+        for (int m = 0; m < n_models; m++){
+            chunk_outputs[c][m] = restored[c * n_models + m];
+        }
+    }
+    if (m_checkpoint && (int)pending.size() < n_chunks){
+        LOG << "PETDriver::FitVoxels - " << n_chunks - pending.size() << " of " << n_chunks
+            << " chunks restored from checkpoint" << endl;
+    }
+
+    PETWorkQueue queue(pending.size(), n_workers);
+    mutex error_mutex;
+    exception_ptr error;
+
+    // Chunk logs are written in voxel order as soon as every earlier chunk
+    // is done, so only the logs of chunks which finished early are held
+    mutex log_mutex;
+    vector<bool> chunk_done(n_chunks, true);
+    for (size_t i = 0; i < pending.size(); i++){
+        chunk_done[pending[i]] = false;
+    }
+    int next_log = 0;
+    auto flush_logs = [&]() {
+        while (next_log < n_chunks && chunk_done[next_log]){
+            LOG << chunk_logs[next_log];
+            string().swap(chunk_logs[next_log]);
+            next_log++;
+        }
+    };
+
+    // Each worker fits chunks with its own models and run data. All models
+    // are fitted to a chunk in turn while its data is still in cache
+    auto worker = [&](int w) {
+        int item;
+        while (queue.Next(w, item)){
+            int chunk = pending[item];
+            {
+                lock_guard<mutex> lock(error_mutex);
+                if (error){
+                    break;
+                }
+            }
+            try{
+                int first = chunk * chunk_size + 1;
+                int last = min(first + chunk_size - 1, n_voxels);
+                Matrix chunk_coords = coords.Columns(first, last);
+                Matrix chunk_data = data.Columns(first, last);
+
+                ostringstream log_stream;
+                EasyLog chunk_log;
+                chunk_log.StartLog(log_stream);
+
+                for (int m = 0; m < n_models; m++){
+                    models[w][m]->SetLogger(&chunk_log);
+
+                    PETRunData fit;
+                    ParseArgs(fit);
+                    fit.SetLogger(&chunk_log);
+                    fit.Set("output", output_dir);
+                    fit.SetBool("overwrite");
+                    map<string, string>::const_iterator opt;
+                    for (opt = options.begin(); opt != options.end(); ++opt){
+                        fit.Set(opt->first, opt->second);
+                    }
+
+                    fit.SetVoxelCoords(chunk_coords);
+                    fit.SetVoxelData("data", chunk_data);
+                    map<string, Matrix>::const_iterator input;
+                    for (input = voxel_inputs.begin(); input != voxel_inputs.end(); ++input){
+                        Matrix chunk_input = input->second.Columns(first, last);
+                        fit.SetVoxelData(input->first, chunk_input);
+                    }
+
+                    RunInference(models[w][m].get(), fit);
+                    if (m_checkpoint){
+                        m_checkpoint->Save(input_hash, chunk * n_models + m, fit.outputs);
+                    }
+                    chunk_outputs[chunk][m] = fit.outputs;
+                }
+
+                chunk_log.StopLog();
+                lock_guard<mutex> lock(log_mutex);
+                chunk_logs[chunk] = log_stream.str();
+                chunk_done[chunk] = true;
+                flush_logs();
+            }
+            catch (...){
+                lock_guard<mutex> lock(error_mutex);
+                if (!error){
+                    error = current_exception();
+                }
+            }
+        }
+    };
+
+    vector<thread> threads;
+    for (int w = 0; w < n_workers; w++){
+        threads.push_back(thread(worker, w));
+    }
+    for (int w = 0; w < n_workers; w++){
+        threads[w].join();
+    }
+    flush_logs();
+    for (size_t w = 0; w < models.size(); w++){
+        for (int m = 0; m < n_models; m++){
+            models[w][m]->SetLogger(GetLogger());
+        }
+    }
+    if (error){
+        rethrow_exception(error);
+    }
+
+    // Merge in voxel order so the result does not depend on scheduling
+    outputs.assign(n_models, PETVoxelOutputs());
+    for (int c = 0; c < n_chunks; c++){
+        int first = c * chunk_size + 1;
+        for (int m = 0; m < n_models; m++){
+            map<string, Matrix>::iterator it;
+            for (it = chunk_outputs[c][m].data.begin(); it != chunk_outputs[c][m].data.end(); ++it){
+                Matrix &merged = outputs[m].data[it->first];
+                if (merged.Ncols() != n_voxels){
+                    merged.ReSize(it->second.Nrows(), n_voxels);
+                    merged = 0.0;
+                    outputs[m].types[it->first] = chunk_outputs[c][m].types[it->first];
+                }
+                merged.SubMatrix(1, it->second.Nrows(), first, first + it->second.Ncols() - 1) = it->second;
+            }
+        }
+    }
+}
+
+void PETDriver::CreateModels(FabberRunData &io, const vector<string> &names,
+                             vector<PETModelSet> &models) const
+{
+    // Models share the operators built by the first one initialized
+    models.clear();
+    for (int i = 0; i < NumThreads(); i++){
+        PETModelSet set;
+        for (size_t m = 0; m < names.size(); m++){
+            shared_ptr<FwdModel> model(FwdModel::NewFromName(names[m]));
+            model->SetLogger(GetLogger());
+            model->Initialize(io);
+            set.push_back(model);
+        }
+        models.push_back(set);
+    }
+}
+
+int PETDriver::NumThreads() const
+{
+    int n_threads = GetIntOption("threads", 1);
+    if (n_threads <= 0){
+        n_threads = max(1u, thread::hardware_concurrency());
+    }
+    return n_threads;
+}
+
+void PETDriver::CheckVoxelwise(FabberRunData &io) const
+{
+    // Chunks are fitted independently so voxels must not be coupled
+    string method = io.GetStringDefault("method", "vb");
+    if (method != "vb" && method != "nlls" && method != "pet_mcmc"){
+        throw InvalidOptionValue("method", method,
+                                 "Chunked fitting needs a voxelwise method (vb, nlls or pet_mcmc)");
+    }
+    string priors = io.GetStringDefault("param-spatial-priors", "");
+    if (priors.find_first_of("MmPp") != string::npos){
+        throw InvalidOptionValue("param-spatial-priors", priors,
+                                 "Spatial priors couple voxels and cannot be fitted in chunks");
+    }
+}
+
+void PETDriver::ParseArgs(FabberRunData &rundata) const
+{
+    vector<string> args = m_args;
+    vector<char *> argv;
+    for (size_t i = 0; i < args.size(); i++){
+        argv.push_back(&args[i][0]);
+    }
+    rundata.Parse(argv.size(), &argv[0]);
+}
+
+void PETDriver::RunInference(FwdModel *model, FabberRunData &rundata) const
+{
+    std::unique_ptr<InferenceTechnique> infer;
+    {
+        // The factory is shared between worker threads
+        static mutex factory_mutex;
+        lock_guard<mutex> lock(factory_mutex);
+        infer.reset(InferenceTechnique::NewFromName(rundata.GetStringDefault("method", "vb")));
+    }
+    infer->SetLogger(rundata.GetLogger());
+    infer->Initialize(model, rundata);
+    infer->DoCalculations(rundata);
+    infer->SaveResults(rundata);
+}
+
+void PETDriver::SaveOutputs(PETVoxelOutputs &outputs, FabberRunData &io) const
+{
+    map<string, Matrix>::iterator it;
+    for (it = outputs.data.begin(); it != outputs.data.end(); ++it){
+        io.SaveVoxelData(it->first, it->second, outputs.types[it->first]);
+    }
+}
+
+bool PETDriver::HaveOption(const std::string &key) const
+{
+    return m_options.find(key) != m_options.end();
+}
+
+string PETDriver::GetOption(const std::string &key, const std::string &def) const
+{
+    map<string, string>::const_iterator it = m_options.find(key);
+    if (it == m_options.end()){
+        return def;
+    }
+    return it->second;
+}
+
+int PETDriver::GetIntOption(const std::string &key, int def) const
+{
+    string value = GetOption(key, "");
+    if (value == ""){
+        return def;
+    }
+    istringstream is(value);
+    int result;
+    if (!(is >> result) || !is.eof()){
+        throw InvalidOptionValue(key, value, "Must be an integer");
+    }
+    return result;
+}
+
+double PETDriver::GetDoubleOption(const std::string &key, double def) const
+{
+    string value = GetOption(key, "");
+    if (value == ""){
+        return def;
+    }
+    istringstream is(value);
+    double result;
+    if (!(is >> result) || !is.eof()){
+        throw InvalidOptionValue(key, value, "Must be a number");
+    }
+    return result;
+}
@@ -0,0 +1,136 @@
+/**
+ * pet_driver.h
+ *
+ * Execution modes of the fabber_pet executable which go beyond a single
+ * fabber run, e.g. incremental fitting while frames are still arriving.
+ */
+
+#pragma once
+
+#include <fabber_core/fwdmodel.h>
+#include <fabber_core/rundata.h>
+
+#include <armawrap/newmat.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Voxelwise outputs of a fit, one column per voxel
+ */
+struct PETVoxelOutputs
+{
+    std::map<std::string, NEWMAT::Matrix> data;
+    std::map<std::string, VoxelDataType> types;
+};
+
+/**
+ * Run data which keeps voxel outputs in memory so the driver can merge and
+ * save them itself
+ */
+class PETRunData : public FabberRunData
+{
+public:
+    virtual void SaveVoxelData(const std::string &filename, NEWMAT::Matrix &data,
+                               VoxelDataType data_type = VDT_SCALAR);
+
+    PETVoxelOutputs outputs;
+};
+
+class PETCheckpoint;
+
+/**
+ * One initialized instance of each model being fitted
+ */
+typedef std::vector<std::shared_ptr<FwdModel> > PETModelSet;
+
+/**
+ * Entry point of fabber_pet. Without any driver options the command line is
+ * handed unchanged to the standard fabber executable.
+ */
+class PETDriver : public Loggable
+{
+public:
+    PETDriver(int argc, char **argv);
+    ~PETDriver();
+
+    int Execute();
+
+private:
+    void Usage() const;
+    void Run(FabberRunData &io);
+    void RunParallel(FabberRunData &io);
+    void RunSlabs(FabberRunData &io);
+    void RunIncremental(FabberRunData &io);
+    void RunCompare(FabberRunData &io);
+
+    /**
+     * Fit a set of voxels, skipping those which fail the pre-screen if
+     * screening is enabled
+     *
+     * @param models       One model set per worker
+     * @param voxel_inputs Additional voxel data (e.g. an MVN to continue
+     *                     from) which is split into chunks alongside data
+     * @param options      Options to set on every chunk's run data
+     * @param outputs      Outputs of each model in the set
+     */
+    void FitVoxels(FabberRunData &io, const NEWMAT::Matrix &data, const NEWMAT::Matrix &coords,
+                   std::vector<PETModelSet> &models,
+                   const std::map<std::string, NEWMAT::Matrix> &voxel_inputs,
+                   const std::map<std::string, std::string> &options,
+                   std::vector<PETVoxelOutputs> &outputs);
+
+    /**
+     * Fit a set of voxels in chunks on a work-stealing thread pool
+     *
+     * Each worker uses its own set of initialized models, and fits every
+     * model of the set to a chunk before moving on. Outputs are merged in
+     * voxel order so they do not depend on the scheduling. When
+     * checkpointing, chunks already in the checkpoint are not refitted.
+     */
+    void FitChunks(FabberRunData &io, const NEWMAT::Matrix &data, const NEWMAT::Matrix &coords,
+                   std::vector<PETModelSet> &models,
+                   const std::map<std::string, NEWMAT::Matrix> &voxel_inputs,
+                   const std::map<std::string, std::string> &options,
+                   std::vector<PETVoxelOutputs> &outputs);
+
+    /**
+     * Outputs of voxels skipped by the pre-screen: the prior mean of each
+     * parameter and zero for everything else that the fit would save
+     */
+    void SkippedOutputs(FabberRunData &io, FwdModel *model,
+                        const std::map<std::string, std::string> &options, int n_frames,
+                        int n_voxels, PETVoxelOutputs &outputs) const;
+
+    /**
+     * Label each voxel as fitted (0) or skipped because of low activity (1),
+     * a mostly negative curve (2) or low SNR (3)
+     */
+    void ScreenVoxels(const PETModelSet &models, const NEWMAT::Matrix &data,
+                      NEWMAT::Matrix &screen) const;
+
+    void CreateModels(FabberRunData &io, const std::vector<std::string> &names,
+                      std::vector<PETModelSet> &models) const;
+    int NumThreads() const;
+    void CheckVoxelwise(FabberRunData &io) const;
+
+    void ParseArgs(FabberRunData &rundata) const;
+    void RunInference(FwdModel *model, FabberRunData &rundata) const;
+    void SaveOutputs(PETVoxelOutputs &outputs, FabberRunData &io) const;
+
+    bool HaveOption(const std::string &key) const;
+    std::string GetOption(const std::string &key, const std::string &def) const;
+    int GetIntOption(const std::string &key, int def) const;
+    double GetDoubleOption(const std::string &key, double def) const;
+
+    // Arguments passed on to fabber
+    std::vector<std::string> m_args;
+
+    // Options consumed by the driver
+    std::map<std::string, std::string> m_options;
+
+    // Completed chunks of an earlier run, if checkpointing
+    std::unique_ptr<PETCheckpoint> m_checkpoint;
+};
@@ -0,0 +1,355 @@
+/**
+ * pet_mcmc.cc
+ *
+ * Ensemble MCMC sampling of the posterior of the PET models, for
+ * parameters whose posterior is far from the Gaussian of the VB fit
+ */
+
+#include "pet_mcmc.h"
+#include "fwdmodel_pet.h"
+
+#include <fabber_core/easylog.h>
+#include <fabber_core/priors.h>
+
+#include <armawrap/newmat.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+using namespace NEWMAT;
+
+FactoryRegistration<InferenceTechniqueFactory, PETMCMC> PETMCMC::registration("pet_mcmc");
+
+static OptionSpec OPTIONS[] = {
+    { "mcmc-walkers", OPT_INT,
+        "Number of walkers advanced together in each voxel (even, at least twice the number of parameters)",
+        OPT_NONREQ, "64" },
+    { "mcmc-burnin", OPT_INT, "Number of steps discarded before sampling", OPT_NONREQ, "500" },
+    { "mcmc-samples", OPT_INT, "Number of steps sampled after burn-in", OPT_NONREQ, "1000" },
+    { "mcmc-thin", OPT_INT, "Keep the walkers of every n-th sampled step", OPT_NONREQ, "1" },
+    { "mcmc-stretch", OPT_FLOAT, "Scale of the stretch move (greater than 1)", OPT_NONREQ, "2" },
+    { "mcmc-quantiles", OPT_STR,
+        "Comma separated posterior quantiles to save as qNNN_<name>, NNN in thousandths", OPT_NONREQ,
+        "0.025,0.5,0.975" },
+    { "mcmc-seed", OPT_INT, "Random seed, combined with each voxel's coordinates", OPT_NONREQ, "1" },
+    { "" },
+};
+
+InferenceTechnique *PETMCMC::NewInstance()
+{
+    return new PETMCMC();
+}
+
+std::string PETMCMC::GetDescription() const
+{
+    return "Ensemble MCMC sampling with batched evaluation of the PET models";
+}
+
+std::string PETMCMC::GetVersion() const
+{
+    string version = "Fabber PET MCMC: ";
+#ifdef GIT_SHA1
+    version += string(" Revision ") + GIT_SHA1;
+#endif
+    return version;
+}
+
+void PETMCMC::GetOptions(vector<OptionSpec> &opts) const
+{
+    InferenceTechnique::GetOptions(opts);
+    for (int i = 0; OPTIONS[i].name != ""; i++){
+        opts.push_back(OPTIONS[i]);
+    }
+}
+
+void PETMCMC::Initialize(FwdModel *fwd_model, FabberRunData &rundata)
+{
+    InferenceTechnique::Initialize(fwd_model, rundata);
+    m_fwd_model = fwd_model;
+
+    // Other models are sampled too, but evaluated one proposal at a time
+    m_pet_model = dynamic_cast<const PETFwdModel *>(fwd_model);
+
+    if (rundata.GetBool("varpro")){
+        throw InvalidOptionValue("varpro", "", "Linear parameters must be sampled rather than solved for");
+    }
+    m_params.clear();
+    m_fwd_model->GetParameters(rundata, m_params);
+    m_outputs.clear();
+    m_fwd_model->GetOutputs(m_outputs);
+
+    int n_params = m_params.size();
+    m_prior_mean.clear();
+    m_prior_var.clear();
+    for (int p = 0; p < n_params; p++){
+        DistParams prior = m_params[p].transform->ToFabber(m_params[p].prior);
+        m_prior_mean.push_back(prior.mean());
+        m_prior_var.push_back(prior.var());
+    }
+
+    m_walkers = rundata.GetIntDefault("mcmc-walkers", 64);
+    if (m_walkers % 2 != 0 || m_walkers < 2 * n_params){
+        throw InvalidOptionValue("mcmc-walkers", to_string(m_walkers),
+                                 "Must be even and at least twice the number of parameters");
+    }
+    m_burnin = rundata.GetIntDefault("mcmc-burnin", 500);
+    if (m_burnin < 0){
+        throw InvalidOptionValue("mcmc-burnin", to_string(m_burnin), "Must not be negative");
+    }
+    m_thin = rundata.GetIntDefault("mcmc-thin", 1);
+    if (m_thin < 1){
+        throw InvalidOptionValue("mcmc-thin", to_string(m_thin), "Must be at least 1");
+    }
+    m_samples = rundata.GetIntDefault("mcmc-samples", 1000);
+    if (m_samples < m_thin){
+        throw InvalidOptionValue("mcmc-samples", to_string(m_samples), "Must be at least mcmc-thin");
+    }
+    m_stretch = rundata.GetDoubleDefault("mcmc-stretch", 2);
+    if (m_stretch <= 1){
+        throw InvalidOptionValue("mcmc-stretch", to_string(m_stretch), "Must be greater than 1");
+    }
+    m_seed = rundata.GetIntDefault("mcmc-seed", 1);
+
+    m_quantiles.clear();
+    string quantiles = rundata.GetStringDefault("mcmc-quantiles", "0.025,0.5,0.975");
+    istringstream list(quantiles);
+    string item;
+    while (getline(list, item, ',')){
+        istringstream is(item);
+        double q;
+        if (!(is >> q) || q < 0 || q > 1){
+            throw InvalidOptionValue("mcmc-quantiles", quantiles, "Must be numbers between 0 and 1");
+        }
+        m_quantiles.push_back(q);
+    }
+
+    LOG << "PETMCMC::Initialize - " << m_walkers << " walkers, " << m_burnin << " burn-in steps, "
+        << m_samples << " sampled steps" << (m_pet_model ? ", batched evaluation" : "") << endl;
+}
+
+void PETMCMC::DoCalculations(FabberRunData &rundata)
+{
+    const Matrix &data = rundata.GetMainVoxelData();
+    const Matrix &coords = rundata.GetVoxelCoords();
+    m_num_voxels = data.Ncols();
+
+    m_mean.ReSize(m_params.size(), m_num_voxels);
+    m_mean = 0.0;
+    m_acceptance.ReSize(1, m_num_voxels);
+    m_acceptance = 0.0;
+    m_quantile_data.clear();
+
+    for (int v = 1; v <= m_num_voxels; v++){
+        ColumnVector y = data.Column(v);
+        ColumnVector voxel_coords = coords.Column(v);
+        m_fwd_model->PassData(v, y, voxel_coords);
+        SampleVoxel(v, y, voxel_coords);
+    }
+
+    if (m_num_voxels > 0){
+        LOG << "PETMCMC::DoCalculations - mean acceptance fraction "
+            << m_acceptance.Sum() / m_num_voxels << endl;
+    }
+}
+
+void PETMCMC::SampleVoxel(int v, const ColumnVector &y, const ColumnVector &coords)
+{
+    int n_params = m_params.size();
+    int half = m_walkers / 2;
+
+    // Seeded from the voxel position so samples do not depend on chunking
+    seed_seq seq = { (unsigned long)m_seed, (unsigned long)coords(1), (unsigned long)coords(2),
+                     (unsigned long)coords(3) };
+    mt19937_64 rng(seq);
+    normal_distribution<double> normal;
+    uniform_real_distribution<double> uniform;
+    uniform_int_distribution<int> partner(0, half - 1);
+
+    // Start in a small ball around the initial posterior mean
+    Matrix walkers(n_params, m_walkers);
+    for (int p = 1; p <= n_params; p++){
+        const Parameter &param = m_params[p - 1];
+        double centre = param.transform->ToFabber(param.post.mean());
+        for (int k = 1; k <= m_walkers; k++){
+            walkers(p, k) = centre + 0.01 * normal(rng);
+        }
+    }
+    ColumnVector log_post;
+    LogPosterior(walkers, y, log_post);
+
+    int n_kept = (m_samples / m_thin) * m_walkers;
+    Matrix chain(n_params, n_kept);
+    int kept = 0;
+    long proposed = 0;
+    long accepted = 0;
+    for (int step = 1; step <= m_burnin + m_samples; step++){
+        for (int h = 0; h < 2; h++){
+            // Walkers of one half are stretched towards walkers of the other,
+            // and all their proposals are evaluated as one batch
+            int first = h * half;
+            int other = (1 - h) * half;
+            Matrix proposals(n_params, half);
+            ColumnVector z(half);
+            for (int k = 1; k <= half; k++){
+                int j = other + partner(rng) + 1;
+                double u = (m_stretch - 1) * uniform(rng) + 1;
+                z(k) = u * u / m_stretch;
+                proposals.Column(k) = walkers.Column(j) + z(k) * (walkers.Column(first + k) - walkers.Column(j));
+            }
+            ColumnVector log_prop;
+            LogPosterior(proposals, y, log_prop);
+
+            for (int k = 1; k <= half; k++){
+                double log_ratio = (n_params - 1) * log(z(k)) + log_prop(k) - log_post(first + k);
+                bool accept = log(uniform(rng)) < log_ratio;
+                if (accept){
+                    walkers.Column(first + k) = proposals.Column(k);
+                    log_post(first + k) = log_prop(k);
+                }
+                if (step > m_burnin){
+                    proposed++;
+                    accepted += accept;
+                }
+            }
+        }
+
+        if (step > m_burnin && (step - m_burnin) % m_thin == 0){
+            chain.Columns(kept + 1, kept + m_walkers) = walkers;
+            kept += m_walkers;
+        }
+    }
+    m_acceptance(1, v) = double(accepted) / proposed;
+
+    // Posterior summaries of the parameters and of the model's derived
+    // outputs, e.g. rate constants or CMRglc
+    Matrix model_chain = ToModel(chain);
+    for (int p = 1; p <= n_params; p++){
+        Matrix row = model_chain.Row(p);
+        m_mean(p, v) = row.Sum() / n_kept;
+        SaveQuantiles(m_params[p - 1].name, v, row);
+    }
+    for (size_t o = 0; o < m_outputs.size(); o++){
+        Matrix values;
+        for (int s = 1; s <= n_kept; s++){
+            ColumnVector sample = model_chain.Column(s);
+            ColumnVector result;
+            m_fwd_model->EvaluateModel(sample, result, m_outputs[o]);
+            if (s == 1){
+                values.ReSize(result.Nrows(), n_kept);
+            }
+            values.Column(s) = result;
+        }
+        SaveQuantiles(m_outputs[o], v, values);
+    }
+}
+
+void PETMCMC::LogPosterior(const Matrix &theta, const ColumnVector &y, ColumnVector &log_post) const
+{
+    int n_params = m_params.size();
+    int n = theta.Ncols();
+    Matrix params = ToModel(theta);
+    Matrix pred;
+    if (m_pet_model){
+        m_pet_model->EvaluateBatch(params, pred);
+    } else{
+        pred.ReSize(y.Nrows(), n);
+        for (int s = 1; s <= n; s++){
+            ColumnVector sample = params.Column(s);
+            ColumnVector result;
+            m_fwd_model->EvaluateModel(sample, result);
+            pred.Column(s) = result;
+        }
+    }
+
+    log_post.ReSize(n);
+    for (int s = 1; s <= n; s++){
+        double ssr = 0;
+        for (int i = 1; i <= y.Nrows(); i++){
+            double r = y(i) - pred(i, s);
+            ssr += r * r;
+        }
+        if (!std::isfinite(ssr)){
+            log_post(s) = -numeric_limits<double>::infinity();
+            continue;
+        }
+
+        // Noise precision integrated out under a Jeffreys prior
+        double lp = -0.5 * y.Nrows() * log(max(ssr, numeric_limits<double>::min()));
+        for (int p = 1; p <= n_params; p++){
+            double d = theta(p, s) - m_prior_mean[p - 1];
+            lp -= 0.5 * d * d / m_prior_var[p - 1];
+        }
+        log_post(s) = lp;
+    }
+}
+
+Matrix PETMCMC::ToModel(const Matrix &theta) const
+{
+    Matrix params(theta.Nrows(), theta.Ncols());
+    for (int p = 1; p <= theta.Nrows(); p++){
+        for (int s = 1; s <= theta.Ncols(); s++){
+            params(p, s) = m_params[p - 1].transform->ToModel(theta(p, s));
+        }
+    }
+    return params;
+}
+
+void PETMCMC::SaveQuantiles(const std::string &name, int v, const Matrix &samples)
+{
+    vector<string> keys;
+    for (size_t q = 0; q < m_quantiles.size(); q++){
+        char label[8];
+        snprintf(label, sizeof(label), "q%03d_", (int)floor(m_quantiles[q] * 1000 + 0.5));
+        string key = label + name;
+        Matrix &out = m_quantile_data[key];
+        if (out.Ncols() != m_num_voxels){
+            out.ReSize(samples.Nrows(), m_num_voxels);
+            out = 0.0;
+        }
+        keys.push_back(key);
+    }
+
+    // Linear interpolation between order statistics, ignoring samples where
+    // the output is undefined
+    for (int r = 1; r <= samples.Nrows(); r++){
+        vector<double> values;
+        for (int s = 1; s <= samples.Ncols(); s++){
+            if (std::isfinite(samples(r, s))){
+                values.push_back(samples(r, s));
+            }
+        }
+        if (values.empty()){
+            continue;
+        }
+        sort(values.begin(), values.end());
+        for (size_t q = 0; q < m_quantiles.size(); q++){
+            double pos = m_quantiles[q] * (values.size() - 1);
+            size_t lo = floor(pos);
+            size_t hi = min(lo + 1, values.size() - 1);
+            m_quantile_data[keys[q]](r, v) = values[lo] + (pos - lo) * (values[hi] - values[lo]);
+        }
+    }
+}
+
+void PETMCMC::SaveResults(FabberRunData &rundata) const
+{
+    for (size_t p = 0; p < m_params.size(); p++){
+        Matrix mean = m_mean.Row(p + 1);
+        rundata.SaveVoxelData("mean_" + m_params[p].name, mean);
+    }
+
+    map<string, Matrix>::const_iterator it;
+    for (it = m_quantile_data.begin(); it != m_quantile_data.end(); ++it){
+        Matrix quantile = it->second;
+        rundata.SaveVoxelData(it->first, quantile, quantile.Nrows() > 1 ? VDT_MULTIPLE : VDT_SCALAR);
+    }
+
+    Matrix acceptance = m_acceptance;
+    rundata.SaveVoxelData("mcmc_acceptance", acceptance);
+}
@@ -0,0 +1,91 @@
+/**
+ * pet_mcmc.h
+ *
+ * Ensemble MCMC sampling of the posterior of the PET models, for
+ * parameters whose posterior is far from the Gaussian of the VB fit
+ */
+
+#pragma once
+
+#include <fabber_core/fwdmodel.h>
+#include <fabber_core/inference.h>
+#include <fabber_core/rundata.h>
+
+#include <armawrap/newmat.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+class PETFwdModel;
+
+/**
+ * Affine-invariant ensemble sampler (stretch move, Goodman & Weare 2010)
+ *
+ * All walkers of a voxel advance in lock-step. The proposals of half the
+ * ensemble are evaluated together, which for the PET models is one batch
+ * of kernels and a single product with the convolution operator.
+ *
+ * Parameters are sampled in fabber's transformed space with the model's
+ * priors. The noise precision is integrated out under a Jeffreys prior,
+ * so the likelihood only depends on the residual sum of squares.
+ */
+class PETMCMC : public InferenceTechnique
+{
+public:
+    static InferenceTechnique *NewInstance();
+
+    PETMCMC()
+        : m_fwd_model(0)
+        , m_pet_model(0)
+        , m_num_voxels(0)
+    {
+    }
+
+    virtual std::string GetDescription() const;
+    virtual std::string GetVersion() const;
+    virtual void GetOptions(std::vector<OptionSpec> &opts) const;
+
+    virtual void Initialize(FwdModel *fwd_model, FabberRunData &rundata);
+    virtual void DoCalculations(FabberRunData &rundata);
+    virtual void SaveResults(FabberRunData &rundata) const;
+
+private:
+    void SampleVoxel(int v, const NEWMAT::ColumnVector &y, const NEWMAT::ColumnVector &coords);
+
+    /** Log posterior of each column of parameters in fabber space */
+    void LogPosterior(const NEWMAT::Matrix &theta, const NEWMAT::ColumnVector &y,
+                      NEWMAT::ColumnVector &log_post) const;
+
+    /** Model space values of each column of parameters in fabber space */
+    NEWMAT::Matrix ToModel(const NEWMAT::Matrix &theta) const;
+
+    /** Save the quantiles of each row of a set of samples for one voxel */
+    void SaveQuantiles(const std::string &name, int v, const NEWMAT::Matrix &samples);
+
+    FwdModel *m_fwd_model;
+    const PETFwdModel *m_pet_model;
+    std::vector<Parameter> m_params;
+    std::vector<std::string> m_outputs;
+
+    // Normal priors of the parameters in fabber space
+    std::vector<double> m_prior_mean;
+    std::vector<double> m_prior_var;
+
+    int m_walkers;
+    int m_burnin;
+    int m_samples;
+    int m_thin;
+    double m_stretch;
+    unsigned long m_seed;
+    std::vector<double> m_quantiles;
+
+    // Results, one column per voxel
+    int m_num_voxels;
+    NEWMAT::Matrix m_mean;
+    NEWMAT::Matrix m_acceptance;
+    std::map<std::string, NEWMAT::Matrix> m_quantile_data;
+
+    /** Auto-register with inference technique factory. */
+    static FactoryRegistration<InferenceTechniqueFactory, PETMCMC> registration;
+};
@@ -0,0 +1,212 @@
+/**
+ * pet_slab_io.cc
+ *
+ * Reading 4D PET data and writing voxelwise outputs one z-slab at a time,
+ * so that total-body studies never have to be held in memory in full.
+ */
+
+#include "pet_slab_io.h"
+
+#include <fabber_core/rundata.h>
+
+#include <armawrap/newmat.h>
+#include <newimage/newimageall.h>
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+using namespace NEWMAT;
+using namespace NEWIMAGE;
+
+// Size of a NIfTI-1 header plus the (empty) extension flag
+static const int NIFTI_DATA_OFFSET = 352;
+
+template <class T>
+static void put(vector<char> &buf, int offset, T value)
+{
+    memcpy(&buf[offset], &value, sizeof(T));
+}
+
+static bool EndsWith(const string &str, const string &suffix)
+{
+    return str.size() >= suffix.size()
+        && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+PETSlabReader::PETSlabReader(const std::string &data_file, const std::string &mask_file)
+    : m_data_file(data_file)
+    , m_have_mask(mask_file != "")
+    , m_z_first(-1)
+    , m_z_last(-1)
+{
+    // Each slab is read with a separate seek into the file, which for
+    // gzipped data means decompressing everything before it again
+    if (!EndsWith(m_data_file, ".nii")){
+        if (ifstream((m_data_file + ".nii").c_str()).good()){
+            m_data_file += ".nii";
+        }
+        else {
+            throw FabberRunDataError("Slab streaming needs uncompressed .nii data: " + data_file);
+        }
+    }
+    read_volume4D_hdr_only(m_hdr, m_data_file);
+    if (m_have_mask){
+        read_volume(m_mask, mask_file);
+        if (m_mask.xsize() != m_hdr.xsize() || m_mask.ysize() != m_hdr.ysize()
+            || m_mask.zsize() != m_hdr.zsize()){
+            throw FabberRunDataError("Mask dimensions do not match the data: " + mask_file);
+        }
+    }
+
+    // Slabs only need to cover the extent of the mask
+    for (int z = 0; z < m_hdr.zsize(); z++){
+        if (NumVoxels(z, z) > 0){
+            if (m_z_first < 0){
+                m_z_first = z;
+            }
+            m_z_last = z;
+        }
+    }
+}
+
+bool PETSlabReader::InMask(int x, int y, int z) const
+{
+    return !m_have_mask || m_mask(x, y, z) > 0;
+}
+
+int PETSlabReader::NumVoxels(int z0, int z1) const
+{
+    int n = 0;
+    for (int z = z0; z <= z1; z++){
+        for (int y = 0; y < m_hdr.ysize(); y++){
+            for (int x = 0; x < m_hdr.xsize(); x++){
+                if (InMask(x, y, z)){
+                    n++;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+void PETSlabReader::ReadSlab(int z0, int z1, Matrix &data, Matrix &coords) const
+{
+    int nx = m_hdr.xsize();
+    int ny = m_hdr.ysize();
+    int nt = m_hdr.tsize();
+
+    volume4D<float> slab;
+    read_volume4DROI(slab, m_data_file, 0, 0, z0, 0, nx - 1, ny - 1, z1, nt - 1);
+
+    // Same voxel order as fabber - x fastest, then y, then z
+    int n = NumVoxels(z0, z1);
+    data.ReSize(nt, n);
+    coords.ReSize(3, n);
+    int v = 1;
+    for (int z = z0; z <= z1; z++){
+        for (int y = 0; y < ny; y++){
+            for (int x = 0; x < nx; x++){
+                if (!InMask(x, y, z)){
+                    continue;
+                }
+                for (int t = 0; t < nt; t++){
+                    data(t + 1, v) = slab(x, y, z - z0, t);
+                }
+                coords(1, v) = x;
+                coords(2, v) = y;
+                coords(3, v) = z;
+                v++;
+            }
+        }
+    }
+}
+
+PETSlabWriter::PETSlabWriter(const std::string &output_dir, const volume4D<float> &ref)
+    : m_output_dir(output_dir)
+    , m_ref(ref)
+{
+}
+
+void PETSlabWriter::Create(const std::string &filename, int n_vols) const
+{
+    vector<char> hdr(NIFTI_DATA_OFFSET, 0);
+    put<int>(hdr, 0, 348);
+
+    // Dimensions and voxel sizes
+    put<short>(hdr, 40, n_vols > 1 ? 4 : 3);
+    put<short>(hdr, 42, m_ref.xsize());
+    put<short>(hdr, 44, m_ref.ysize());
+    put<short>(hdr, 46, m_ref.zsize());
+    put<short>(hdr, 48, n_vols);
+    put<short>(hdr, 50, 1);
+    put<short>(hdr, 52, 1);
+    put<short>(hdr, 54, 1);
+    put<short>(hdr, 70, 16); // NIFTI_TYPE_FLOAT32
+    put<short>(hdr, 72, 32);
+    put<float>(hdr, 76, 1);
+    put<float>(hdr, 80, m_ref.xdim());
+    put<float>(hdr, 84, m_ref.ydim());
+    put<float>(hdr, 88, m_ref.zdim());
+    put<float>(hdr, 92, 1);
+    put<float>(hdr, 108, NIFTI_DATA_OFFSET);
+    put<float>(hdr, 112, 1);
+    hdr[123] = 2; // NIFTI_UNITS_MM
+
+    // Orientation - the sform of the input, or its qform if it has none
+    Matrix xfm = m_ref.sform_code() > 0 ? m_ref.sform_mat() : m_ref.qform_mat();
+    short code = m_ref.sform_code() > 0 ? m_ref.sform_code() : m_ref.qform_code();
+    put<short>(hdr, 254, code);
+    for (int r = 0; r < 3; r++){
+        for (int c = 0; c < 4; c++){
+            put<float>(hdr, 280 + 16 * r + 4 * c, xfm(r + 1, c + 1));
+        }
+    }
+    memcpy(&hdr[344], "n+1\0", 4);
+
+    ofstream out(filename.c_str(), ios::binary | ios::trunc);
+    out.write(&hdr[0], hdr.size());
+
+    // Extend to the full size, unwritten voxels read as zero
+    long size = (long)m_ref.xsize() * m_ref.ysize() * m_ref.zsize() * n_vols * sizeof(float);
+    out.seekp(NIFTI_DATA_OFFSET + size - 1);
+    out.put(0);
+    if (!out){
+        throw FabberRunDataError("Could not create output file: " + filename);
+    }
+}
+
+void PETSlabWriter::Write(const std::string &name, const Matrix &data, const Matrix &coords,
+                          int z0, int z1)
+{
+    string filename = m_output_dir + "/" + name + ".nii";
+    int n_vols = data.Nrows();
+    if (m_created.find(name) == m_created.end()){
+        Create(filename, n_vols);
+        m_created.insert(name);
+    }
+
+    long plane = (long)m_ref.xsize() * m_ref.ysize();
+    long volume = plane * m_ref.zsize();
+    vector<float> buf(plane * (z1 - z0 + 1));
+
+    fstream out(filename.c_str(), ios::binary | ios::in | ios::out);
+    for (int t = 1; t <= n_vols; t++){
+        fill(buf.begin(), buf.end(), 0.0f);
+        for (int v = 1; v <= data.Ncols(); v++){
+            long x = coords(1, v);
+            long y = coords(2, v);
+            long z = coords(3, v);
+            buf[(z - z0) * plane + y * m_ref.xsize() + x] = data(t, v);
+        }
+
+        // Planes of one volume are contiguous in the file
+        out.seekp(NIFTI_DATA_OFFSET + ((t - 1) * volume + z0 * plane) * sizeof(float));
+        out.write((const char *)&buf[0], buf.size() * sizeof(float));
+    }
+    if (!out){
+        throw FabberRunDataError("Could not write output file: " + filename);
+    }
+}
@@ -0,0 +1,79 @@
+/**
+ * pet_slab_io.h
+ *
+ * Reading 4D PET data and writing voxelwise outputs one z-slab at a time,
+ * so that total-body studies never have to be held in memory in full.
+ */
+
+#pragma once
+
+#include <armawrap/newmat.h>
+#include <newimage/newimageall.h>
+
+#include <set>
+#include <string>
+
+/**
+ * Reads z-slabs of masked voxels from a 4D NIfTI image
+ */
+class PETSlabReader
+{
+public:
+    PETSlabReader(const std::string &data_file, const std::string &mask_file);
+
+    /** First and last z plane containing masked voxels (-1 if none) */
+    int FirstSlice() const { return m_z_first; }
+    int LastSlice() const { return m_z_last; }
+
+    /** Number of masked voxels in planes z0 to z1 */
+    int NumVoxels(int z0, int z1) const;
+
+    /**
+     * Read the masked voxels of planes z0 to z1
+     *
+     * @param data   One column per voxel, one row per frame
+     * @param coords Zero-based x, y, z of each voxel in the full volume
+     */
+    void ReadSlab(int z0, int z1, NEWMAT::Matrix &data, NEWMAT::Matrix &coords) const;
+
+    const NEWIMAGE::volume4D<float> &Header() const { return m_hdr; }
+
+private:
+    bool InMask(int x, int y, int z) const;
+
+    std::string m_data_file;
+    NEWIMAGE::volume4D<float> m_hdr;
+    NEWIMAGE::volume<float> m_mask;
+    bool m_have_mask;
+    int m_z_first;
+    int m_z_last;
+};
+
+/**
+ * Writes voxelwise outputs to uncompressed NIfTI files slab by slab
+ *
+ * Each file is created with its full size the first time an output is
+ * written, then every slab is written in place. Voxels never written
+ * (outside the mask or in skipped slabs) read as zero.
+ */
+class PETSlabWriter
+{
+public:
+    PETSlabWriter(const std::string &output_dir, const NEWIMAGE::volume4D<float> &ref);
+
+    /**
+     * Write one output for the voxels of a slab
+     *
+     * @param data   One column per voxel, one row per output volume
+     * @param coords Zero-based x, y, z of each voxel in the full volume
+     */
+    void Write(const std::string &name, const NEWMAT::Matrix &data, const NEWMAT::Matrix &coords,
+               int z0, int z1);
+
+private:
+    void Create(const std::string &filename, int n_vols) const;
+
+    std::string m_output_dir;
+    const NEWIMAGE::volume4D<float> &m_ref;
+    std::set<std::string> m_created;
+};
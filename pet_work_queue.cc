@@ -0,0 +1,47 @@
+/**
+ * pet_work_queue.cc
+ *
+ * Work-stealing queue of voxel chunks for the parallel fabber_pet driver
+ */
+
+#include "pet_work_queue.h"
+
+using namespace std;
+
+PETWorkQueue::PETWorkQueue(int n_items, int n_workers)
+{
+    for (int w = 0; w < n_workers; w++){
+        m_workers.push_back(unique_ptr<WorkerItems>(new WorkerItems()));
+    }
+
+    // Contiguous blocks keep neighbouring voxels on the same worker
+    for (int i = 0; i < n_items; i++){
+        m_workers[(long)i * n_workers / n_items]->items.push_back(i);
+    }
+}
+
+bool PETWorkQueue::Next(int worker, int &item)
+{
+    int n_workers = m_workers.size();
+    {
+        WorkerItems &own = *m_workers[worker];
+        lock_guard<mutex> lock(own.mutex);
+        if (!own.items.empty()){
+            item = own.items.front();
+            own.items.pop_front();
+            return true;
+        }
+    }
+
+    // Steal from the far end of another worker's block
+    for (int i = 1; i < n_workers; i++){
+        WorkerItems &victim = *m_workers[(worker + i) % n_workers];
+        lock_guard<mutex> lock(victim.mutex);
+        if (!victim.items.empty()){
+            item = victim.items.back();
+            victim.items.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,39 @@
+/**
+ * pet_work_queue.h
+ *
+ * Work-stealing queue of voxel chunks for the parallel fabber_pet driver
+ */
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * Each worker starts with a contiguous block of chunks which it takes from
+ * the front. A worker whose block is exhausted steals from the back of the
+ * other workers' blocks, so slow voxels do not leave cores idle.
+ */
+class PETWorkQueue
+{
+public:
+    PETWorkQueue(int n_items, int n_workers);
+
+    /**
+     * Get the next item for a worker
+     *
+     * @return false once every item has been handed out
+     */
+    bool Next(int worker, int &item);
+
+private:
+    struct WorkerItems
+    {
+        std::mutex mutex;
+        std::deque<int> items;
+    };
+
+    std::vector<std::unique_ptr<WorkerItems> > m_workers;
+};